@@ -42,7 +42,6 @@
 */
 
 #include <Servo.h>
-#include <Wire.h>
 #include <Firmata.h>
 
 // SoftwareSerial is only supported for AVR-based boards
@@ -53,9 +52,15 @@
 #endif
 #include "utility/serialUtils.h"
 #include "utility/Encoder.h"
+#include "utility/EncoderReport.h"
 #include "utility/OneWire.h"
 #include "utility/Stepper.h"
+#include "utility/StepperGroup.h"
 #include "utility/Encoder7Bit.h"
+#include "utility/I2CQueue.h" // includes Wire.h when the TWI interrupt is not used
+#include "utility/BufferedStream.h"
+#include "utility/TaskScheduler.h"
+#include "utility/AnalogStream.h"
 
 
 #define I2C_WRITE                   B00000000
@@ -64,19 +69,131 @@
 #define I2C_STOP_READING            B00011000
 #define I2C_READ_WRITE_MODE_MASK    B00011000
 #define I2C_10BIT_ADDRESS_MODE_MASK B00100000
+#ifndef I2C_MAX_QUERIES
+#if defined(RAMEND) && RAMEND < 0x1000
 #define I2C_MAX_QUERIES             8
+#else
+#define I2C_MAX_QUERIES             32
+#endif
+#endif
+#if I2C_MAX_QUERIES > 255
+#error "I2C_MAX_QUERIES must be 255 or less, query indexes are bytes"
+#endif
+#define I2C_NO_QUERY                0xFF   // findI2CQuery() found none
 #define I2C_REGISTER_NOT_SPECIFIED  -1
+#ifndef I2C_MAX_READ
+#if defined(RAMEND) && RAMEND < 0x1000
+#define I2C_MAX_READ                32     // bytes in one I2C read
+#else
+#define I2C_MAX_READ                128
+#endif
+#endif
+#ifndef I2C_PENDING_READS
+#if defined(RAMEND) && RAMEND < 0x1000
+#define I2C_PENDING_READS           2      // I2C_READ requests waiting for the bus
+#define I2C_PENDING_WRITES          2      // I2C_WRITE requests queued or on the bus
+#else
+#define I2C_PENDING_READS           8
+#define I2C_PENDING_WRITES          4
+#endif
+#endif
+#define I2C_MAX_WRITE               (MAX_DATA_BYTES / 2)
+#define I2C_REGISTER_NONE_14BIT     0x3FFF // register field value meaning no register
+#define I2C_DEADBAND_WORDS          4      // 16-bit values compared against the deadband
+#define I2C_DEADBAND_LITTLE_ENDIAN  0x2000 // deadband flag, values are sent low byte first
+#define I2C_DEFAULT_KEEPALIVE       1000   // ms between unchanged replies in change-only mode
+#define I2C_BURST_REQUEST           0x01   // user defined sysex, several reads in one reply
+#define I2C_BURST_MAX_READS         8
+#define I2C_BURST_SIZE              64     // reply bytes, 3 per read plus the data
+
+#define SERIAL_REPLY_PACKED         0x00 // SERIAL_MESSAGE mode, reply with 8 bits packed into 7
+#define SERIAL_READ_PACKED          0x40 // SERIAL_READ flag, ask for packed replies
+#define SERIAL_NO_DELIMITER         0x3FFF
+#define SERIAL_SW_PORTS             4    // SW_SERIAL0 to SW_SERIAL3
+
+// serial_port_info.type
+#define SERIAL_PORT_NONE            0
+#define SERIAL_PORT_HARDWARE        1
+#define SERIAL_PORT_SOFTWARE        2
+#ifndef SERIAL_BATCH_SIZE
+#if defined(RAMEND) && RAMEND < 0x1000
+#define SERIAL_BATCH_SIZE           32   // bytes held per batched port
+#define SERIAL_BATCH_PORTS          2    // ports that can batch at the same time
+#else
+#define SERIAL_BATCH_SIZE           64
+#define SERIAL_BATCH_PORTS          4
+#endif
+#endif
+
+// bytes the host link takes without blocking, the buffered reports are
+// written all at once by older cores
+#if defined(ARDUINO) && ARDUINO >= 10606
+#define FIRMATA_TX_SPACE()          Serial.availableForWrite()
+#else
+#define FIRMATA_TX_SPACE()          BUFFERED_STREAM_SIZE
+#endif
+
+// when the host link falls behind, analog and continuous I2C reports are
+// dropped and serial relays deferred, keeping TX_RESERVE bytes for the
+// stepper, encoder and digital reports that must not be lost
+#define TX_RESERVE                  24
+// most txRoom() reaches once the link has caught up, a droppable report
+// must fit in it
+#if defined(ARDUINO) && ARDUINO >= 10606 && defined(SERIAL_TX_BUFFER_SIZE)
+#define TX_ROOM_MAX                 (BUFFERED_STREAM_SIZE + SERIAL_TX_BUFFER_SIZE - 1 - TX_RESERVE)
+#else
+#define TX_ROOM_MAX                 (BUFFERED_STREAM_SIZE - TX_RESERVE)
+#endif
+#define TX_STATS_QUERY              0x02 // user defined sysex, reply with the counters below
+#define TX_DROPPED_ANALOG           0
+#define TX_DROPPED_I2C              1
+#define TX_DEFERRED_SERIAL          2
+#define TX_COUNTERS                 3
+
+#define SAMPLING_STATS_QUERY        0x03 // user defined sysex, reply with the sampling clock statistics
+#define SAMPLING_CATCH_UP           2    // late sampling ticks still run after a stall, more are skipped
+
+#define ANALOG_BLOCK                0x04 // user defined sysex, all analog inputs of a tick in one report
+#define ANALOG_BLOCK_MASK_BYTES     ((TOTAL_ANALOG_PINS + 6) / 7)
+#define ANALOG_BLOCK_HEADER         (3 + 2)  // framing and the time since the previous block
+#define ANALOG_BLOCK_FULL_HEADER    (ANALOG_BLOCK_HEADER + 2 + 5 + ANALOG_BLOCK_MASK_BYTES)
+#define ANALOG_BLOCK_TICK           4        // micros per unit of the time since the previous block
+#define ANALOG_BLOCK_FULL           0x3FFF   // in place of that time: a full header follows
+#define ANALOG_BLOCK_SYNC           64       // blocks between full headers, a power of 2
+
+#define ANALOG_STREAM               0x05 // user defined sysex, interrupt driven analog sampling
+#define ANALOG_STREAM_HEADER        (3 + 2 + 2 + 5) // then ANALOG_STREAM_BLOCK samples, see AnalogStream.h
 
 // the minimum interval for sampling analog input
 #define MINIMUM_SAMPLING_INTERVAL   1
 
-#define MAX_ENCODERS                5 // arbitrary value, may need to adjust
+// one encoder per pair of interrupt pins, but at least 5 for polled encoders
+#if defined(CORE_NUM_INTERRUPT) && CORE_NUM_INTERRUPT > 10
+#define MAX_ENCODERS                (CORE_NUM_INTERRUPT / 2)
+#else
+#define MAX_ENCODERS                5
+#endif
+#if MAX_ENCODERS > 16
+#define ENCODER_SLOT_TYPE           uint32_t
+#else
+#define ENCODER_SLOT_TYPE           uint16_t
+#endif
+#define ENCODER_SLOT(encoderNum)    ((ENCODER_SLOT_TYPE)1 << (encoderNum))
+// lowest attached encoder in a slot mask, to walk only the live slots
+#define ENCODER_FIRST_SLOT(slots)   ((byte)__builtin_ctzl(slots))
 #define ENCODER_ATTACH              0x00
 #define ENCODER_REPORT_POSITION     0x01
 #define ENCODER_REPORT_POSITIONS    0x02
 #define ENCODER_RESET_POSITION      0x03
 #define ENCODER_REPORT_AUTO         0x04
 #define ENCODER_DETACH              0x05
+#define ENCODER_REPORT_VELOCITY     0x06
+#define ENCODER_REPORT_DELTAS       0x7F // marks a delta report, never a valid encoder byte
+#define ENCODER_REPORT_TIMED        0x7E // marks a position, velocity and time report
+#define ENCODER_AUTO_ABSOLUTE       0x01 // ENCODER_REPORT_AUTO modes
+#define ENCODER_AUTO_DELTA          0x02
+#define ENCODER_AUTO_VELOCITY       0x03
+#define ENCODER_KEYFRAME_INTERVAL   50   // sampling intervals between absolute reports in delta mode
 
 #define MAX_STEPPERS                6     // arbitrary value... may need to adjust
 #define STEPPER_CONFIG              0x00
@@ -91,6 +208,9 @@
 #define STEPPER_SET_HOME            0x09
 #define STEPPER_LIMIT_SWITCH_A      0x0a
 #define STEPPER_LIMIT_SWITCH_B      0x0b
+#define STEPPER_GROUP_MOVE          0x0c
+#define STEPPER_QUEUE_STEP          0x0d
+#define STEPPER_QUEUE_DEPTH         0x0e
 
 #define ONEWIRE_SEARCH_REQUEST        0x40
 #define ONEWIRE_CONFIG_REQUEST        0x41
@@ -119,6 +239,12 @@
 
 /* analog inputs */
 int analogInputsToReport = 0; // bitwise array to store pin reporting
+boolean analogBlocks = false;      // report the analog inputs in ANALOG_BLOCK messages
+unsigned int analogBlockSeq = 0;   // sequence number of the next block, 14 bits
+unsigned int analogBlockMask;      // analog pins in the last block sent
+unsigned long analogBlockTime;     // time of the last block sent, as the host adds it up
+boolean analogBlockSync = true;    // the next block needs a full header
+unsigned int analogStreamSeq = 0;  // sequence number of the next ANALOG_STREAM message, 14 bits
 
 /* digital input ports */
 byte reportPINs[TOTAL_PORTS];       // 1 = report this port, 0 = silence
@@ -129,21 +255,57 @@ byte pinConfig[TOTAL_PINS];         // configuration of every pin
 byte portConfigInputs[TOTAL_PORTS]; // each bit: 1 = pin in INPUT, 0 = anything else
 int pinState[TOTAL_PINS];           // any value that has been written
 
+/* reports of one loop() pass, written to the host together */
+BufferedStream firmataStream(Serial);
+unsigned long txCounters[TX_COUNTERS];  // reports dropped or deferred for lack of room
+
 /* timer variables */
-unsigned long currentMillis;        // store the current value from millis()
-unsigned long previousMillis;       // for comparison with currentMillis
 unsigned int samplingInterval = 19; // how often to run the main loop (in ms)
 
+/* loop() tasks */
+TaskScheduler scheduler;
+signed char samplingTaskId;
+unsigned long samplingStatsStart;   // millis() when the sampling statistics were cleared
+
 /* serial message */
-Stream *swSerial0 = NULL;
-Stream *swSerial1 = NULL;
-Stream *swSerial2 = NULL;
-Stream *swSerial3 = NULL;
+// bytes held back until a delimiter, a full batch or an idle gap
+struct serial_batch {
+  signed char portId;               // -1 when unused
+  int delimiter;                    // SERIAL_NO_DELIMITER for none
+  unsigned int idleTime;            // ms without new bytes before sending, 0 for none
+  unsigned long lastByte;           // millis() of the last byte received
+  byte size;                        // bytes sent at most in one reply
+  byte count;
+  byte data[SERIAL_BATCH_SIZE];
+};
 
+serial_batch serialBatch[SERIAL_BATCH_PORTS];
+
+// serial ports by port id
+struct serial_port_info {
+  Stream *stream;                   // NULL while the port can't be used
+  byte type;
+  int bytesToRead;                  // most bytes relayed per loop(), 0 for all available
+  boolean replyPacked;
+  serial_batch *batch;              // NULL unless the replies are batched
+};
+
+serial_port_info serialPorts[SERIAL_READ_ARR_LEN];
 byte reportSerial[MAX_SERIAL_PORTS];
-int serialBytesToRead[SERIAL_READ_ARR_LEN];
 signed char serialIndex;
 
+#if defined(SoftwareSerial_h)
+// SoftwareSerial instances are kept once created and reused by SERIAL_CONFIG
+// on the same pins, so opening and closing a port doesn't fragment the heap
+struct sw_serial_info {
+  SoftwareSerial *port;
+  byte rxPin;
+  byte txPin;
+};
+
+sw_serial_info swSerials[SERIAL_SW_PORTS];
+#endif
+
 struct ow_device_info
 {
   OneWire* device;
@@ -158,26 +320,58 @@ struct i2c_device_info {
   byte addr;
   int reg;
   byte bytes;
+  unsigned int period;              // ms between continuous reads, 0 follows samplingInterval
+  unsigned long due;                // millis() of the next continuous read
+  // change-only replies
+  boolean changeOnly;
+  unsigned int deadband;            // with the I2C_DEADBAND_LITTLE_ENDIAN flag
+  unsigned int keepalive;           // ms after which an unchanged reply is sent anyway
+  unsigned long lastReport;
+  int lastWords[I2C_DEADBAND_WORDS];  // first values of the last reply sent
+  unsigned int lastSum;             // checksum of the rest of the last reply sent
 };
 
 /* for i2c read continuous more */
 i2c_device_info query[I2C_MAX_QUERIES];
 
-byte i2cRxData[32];
+struct i2c_read_request {
+  byte addr;
+  int reg;
+  byte bytes;
+};
+
+byte i2cRxData[I2C_MAX_READ + 2];
 boolean isI2CEnabled = false;
-signed char queryIndex = -1;
-// default delay time between i2c read request and Wire.requestFrom()
+byte i2cQueryCount = 0;
+// default delay time between writing the register and reading the data
 unsigned int i2cReadDelayTime = 0;
+I2CTransfer i2cTransfer;            // read in progress, replied to once complete
+boolean i2cTransferIsQuery;         // i2cTransfer is a continuous read
+i2c_read_request i2cPendingReads[I2C_PENDING_READS]; // I2C_READ waiting for the bus, oldest first
+byte i2cPendingReadCount = 0;
+I2CTransfer i2cWrites[I2C_PENDING_WRITES];          // free when I2C_TRANSFER_IDLE
+byte i2cWriteData[I2C_PENDING_WRITES][I2C_MAX_WRITE];
+unsigned long i2cNextDue;           // earliest due time of the continuous reads
+I2CTransfer i2cBurst[I2C_BURST_MAX_READS];
+byte i2cBurstData[I2C_BURST_SIZE];
+byte i2cBurstReads = 0;             // reads of the burst in progress
 
 Stepper *stepper[MAX_STEPPERS];
 byte numSteppers = 0;
 bool stepperSwitches[MAX_STEPPERS * 2];
+StepperGroup stepperGroup;
+byte stepperGroupDevice;            // device reported in STEPPER_DONE for the group
+byte stepperQueueDepth[MAX_STEPPERS]; // queue depth last reported to the host
 
 Encoder encoders[MAX_ENCODERS];
 int32_t positions[MAX_ENCODERS];
 int32_t prevPositions[MAX_ENCODERS];
-byte numAttachedEncoders = 0;
+int32_t prevVelocities[MAX_ENCODERS];
+ENCODER_SLOT_TYPE attachedEncoders = 0; // bit n set when encoders[n] is attached
+ENCODER_SLOT_TYPE polledEncoders = 0;   // attached encoders without two interrupt pins
 byte reportEncoders = 0x00;
+byte encoderKeyframeInterval = ENCODER_KEYFRAME_INTERVAL;
+byte encoderKeyframeCount = 0;
 
 Servo servos[MAX_SERVOS];
 byte servoPinMap[TOTAL_PINS];
@@ -189,73 +383,281 @@ boolean isResetting = false;
 
 
 /* utility functions */
-void wireWrite(byte data)
+
+/*==============================================================================
+   FUNCTIONS
+  ============================================================================*/
+
+/*
+   Bytes a report that can be dropped or deferred may take now without
+   waiting for the host link: the free staging buffer, then what the
+   serial TX buffer takes as the full staging buffer hands on to it.
+*/
+int txRoom()
 {
-#if ARDUINO >= 100
-  Wire.write((byte)data);
+#if defined(ARDUINO) && ARDUINO >= 10606
+  return firmataStream.space() + FIRMATA_TX_SPACE() - TX_RESERVE;
 #else
-  Wire.send(data);
+  return firmataStream.space() - TX_RESERVE;
 #endif
 }
 
-byte wireRead(void)
+#if defined(ARDUINO) && ARDUINO >= 10606
+int firmataTxSpace()
 {
-#if ARDUINO >= 100
-  return Wire.read();
-#else
-  return Wire.receive();
+  return FIRMATA_TX_SPACE();
+}
 #endif
+
+// Write a count as 28 bits, 7 bits at a time, saturating
+void writeCount(unsigned long count)
+{
+  if (count > 0x0FFFFFFFUL) {
+    count = 0x0FFFFFFFUL;
+  }
+  Firmata.write((byte)count & 0x7F);
+  Firmata.write((byte)(count >> 7) & 0x7F);
+  Firmata.write((byte)(count >> 14) & 0x7F);
+  Firmata.write((byte)(count >> 21) & 0x7F);
 }
 
-/*==============================================================================
-   FUNCTIONS
-  ============================================================================*/
+/*
+   Reply to TX_STATS_QUERY with the analog and I2C reports dropped, the
+   serial relays deferred and the reports that had to wait for the host
+   link, in that order. A first argument of 1 clears the counters after
+   replying.
+*/
+void reportTxStats(byte argc, byte *argv)
+{
+  Firmata.write(START_SYSEX);
+  Firmata.write(TX_STATS_QUERY);
+  for (byte i = 0; i < TX_COUNTERS; i++) {
+    writeCount(txCounters[i]);
+  }
+  writeCount(firmataStream.stalls());
+  Firmata.write(END_SYSEX);
+  if (argc > 0 && argv[0] == 1) {
+    resetTxStats();
+  }
+}
+
+void resetTxStats()
+{
+  for (byte i = 0; i < TX_COUNTERS; i++) {
+    txCounters[i] = 0;
+  }
+  firmataStream.resetStalls();
+}
+
+/*
+   Reply to SAMPLING_STATS_QUERY with the sampling period in micros, the
+   ticks run, the ticks skipped after stalls, the most micros a tick
+   started late and the ms over which these were counted, so the host can
+   work out the achieved rate. A first argument of 1 clears the statistics
+   after replying.
+*/
+void reportSamplingStats(byte argc, byte *argv)
+{
+  Firmata.write(START_SYSEX);
+  Firmata.write(SAMPLING_STATS_QUERY);
+  writeCount(scheduler.getPeriod(samplingTaskId));
+  writeCount(scheduler.getRuns(samplingTaskId));
+  writeCount(scheduler.getSkipped(samplingTaskId));
+  writeCount(scheduler.getMaxLate(samplingTaskId));
+  writeCount(millis() - samplingStatsStart);
+  Firmata.write(END_SYSEX);
+  if (argc > 0 && argv[0] == 1) {
+    clearSamplingStats();
+  }
+}
+
+void clearSamplingStats()
+{
+  scheduler.clearStats(samplingTaskId);
+  samplingStatsStart = millis();
+}
 
 // get a pointer to the serial port associated with the specified port id
 Stream* getPortFromId(byte portId)
 {
-  switch (portId) {
-    case HW_SERIAL0:
-      // block use of Serial (typically pins 0 and 1) until ability to reclaim Serial is implemented
-      //return &Serial;
-      return NULL;
+  if (portId >= SERIAL_READ_ARR_LEN) {
+    return NULL;
+  }
+  return serialPorts[portId].stream;
+}
+
+/*
+   Empty the port table and enter the hardware ports of the board. Serial
+   (typically pins 0 and 1) stays blocked until ability to reclaim Serial is
+   implemented. Software ports are entered by SERIAL_CONFIG.
+*/
+void resetSerialPorts()
+{
+  for (byte i = 0; i < SERIAL_READ_ARR_LEN; i++) {
+    serialPorts[i].stream = NULL;
+    serialPorts[i].type = SERIAL_PORT_NONE;
+    serialPorts[i].bytesToRead = 0;
+    serialPorts[i].replyPacked = false;
+    serialPorts[i].batch = NULL;
+  }
 #if defined(PIN_SERIAL1_RX)
-    case HW_SERIAL1:
-      return &Serial1;
+  serialPorts[HW_SERIAL1].stream = &Serial1;
+  serialPorts[HW_SERIAL1].type = SERIAL_PORT_HARDWARE;
 #endif
 #if defined(PIN_SERIAL2_RX)
-    case HW_SERIAL2:
-      return &Serial2;
+  serialPorts[HW_SERIAL2].stream = &Serial2;
+  serialPorts[HW_SERIAL2].type = SERIAL_PORT_HARDWARE;
 #endif
 #if defined(PIN_SERIAL3_RX)
-    case HW_SERIAL3:
-      return &Serial3;
+  serialPorts[HW_SERIAL3].stream = &Serial3;
+  serialPorts[HW_SERIAL3].type = SERIAL_PORT_HARDWARE;
 #endif
 #if defined(SoftwareSerial_h)
-    case SW_SERIAL0:
-      if (swSerial0 != NULL) {
-        // instances of SoftwareSerial are already pointers so simply return the instance
-        return swSerial0;
-      }
-      break;
-    case SW_SERIAL1:
-      if (swSerial1 != NULL) {
-        return swSerial1;
-      }
-      break;
-    case SW_SERIAL2:
-      if (swSerial2 != NULL) {
-        return swSerial2;
+  for (byte i = 0; i < SERIAL_SW_PORTS; i++) {
+    if (swSerials[i].port != NULL) {
+      swSerials[i].port->end();
+    }
+  }
+#endif
+}
+
+#if defined(SoftwareSerial_h)
+// Get the SoftwareSerial for a port, creating it only when the pins change
+SoftwareSerial *openSoftwareSerial(byte portId, byte rxPin, byte txPin)
+{
+  sw_serial_info *info = &swSerials[portId - SW_SERIAL0];
+
+  if (info->port != NULL && (info->rxPin != rxPin || info->txPin != txPin)) {
+    delete info->port;
+    info->port = NULL;
+  }
+  if (info->port == NULL) {
+    info->port = new SoftwareSerial(rxPin, txPin);
+    info->rxPin = rxPin;
+    info->txPin = txPin;
+  } else {
+    // a reset may have changed the pins, set them up again as the
+    // constructor does
+    pinMode(txPin, OUTPUT);
+    digitalWrite(txPin, HIGH);
+    pinMode(rxPin, INPUT);
+    digitalWrite(rxPin, HIGH);
+  }
+  return info->port;
+}
+#endif
+
+// Relay bytes from a serial port packed 8 bits into 7, as in ONEWIRE_READ_REPLY
+void relaySerialPacked(Stream *serialPort, int numBytesToRead)
+{
+  Encoder7Bit.startBinaryWrite();
+  while (numBytesToRead > 0) {
+    Encoder7Bit.writeBinary(serialPort->read());
+    numBytesToRead--;
+  }
+  Encoder7Bit.endBinaryWrite();
+}
+
+serial_batch *findSerialBatch(signed char portId)
+{
+  for (byte i = 0; i < SERIAL_BATCH_PORTS; i++) {
+    if (serialBatch[i].portId == portId) {
+      return &serialBatch[i];
+    }
+  }
+  return NULL;
+}
+
+// Send the bytes held for a port in one SERIAL_REPLY
+void sendSerialBatch(serial_batch *batch)
+{
+  byte portId = batch->portId;
+
+  Firmata.write(START_SYSEX);
+  Firmata.write(SERIAL_MESSAGE);
+  if (serialPorts[portId].replyPacked) {
+    Firmata.write(SERIAL_REPLY_PACKED | portId);
+    Encoder7Bit.startBinaryWrite();
+    for (byte i = 0; i < batch->count; i++) {
+      Encoder7Bit.writeBinary(batch->data[i]);
+    }
+    Encoder7Bit.endBinaryWrite();
+  } else {
+    Firmata.write(SERIAL_REPLY | portId);
+    for (byte i = 0; i < batch->count; i++) {
+      Firmata.write(batch->data[i] & 0x7F);
+      Firmata.write((batch->data[i] >> 7) & 0x7F);
+    }
+  }
+  Firmata.write(END_SYSEX);
+  batch->count = 0;
+}
+
+// True when the host link has room for a full batch, else count a deferral
+boolean serialBatchFits(serial_batch *batch)
+{
+  if (txRoom() < 3 + 2 * batch->size) {
+    txCounters[TX_DEFERRED_SERIAL]++;
+    return false;
+  }
+  return true;
+}
+
+/*
+   Move the bytes received on a batched port into its batch. The batch is
+   sent as soon as it holds the delimiter or is full, or once no byte has
+   arrived for the idle time, so a line of text goes out in one reply
+   instead of a few bytes per loop().
+*/
+void checkSerialBatch(serial_batch *batch, Stream *serialPort)
+{
+  // leave the bytes in the port until a full batch can be replied, again
+  // after each batch sent
+  if (!serialBatchFits(batch)) {
+    return;
+  }
+  while (serialPort->available() > 0) {
+    byte data = serialPort->read();
+    batch->data[batch->count++] = data;
+    batch->lastByte = millis();
+    if (data == batch->delimiter || batch->count >= batch->size) {
+      sendSerialBatch(batch);
+      if (!serialBatchFits(batch)) {
+        return;
       }
-      break;
-    case SW_SERIAL3:
-      if (swSerial3 != NULL) {
-        return swSerial3;
+    }
+  }
+  if (batch->count > 0 && batch->idleTime > 0 && millis() - batch->lastByte >= batch->idleTime) {
+    sendSerialBatch(batch);
+  }
+}
+
+// Stop batching a port, sending what it holds
+void releaseSerialBatch(byte portId)
+{
+  serial_batch *batch = serialPorts[portId].batch;
+  if (batch != NULL) {
+    if (batch->count > 0) {
+      sendSerialBatch(batch);
+    }
+    batch->portId = -1;
+    serialPorts[portId].batch = NULL;
+  }
+}
+
+// Remove a port from the ports read continuously
+void stopSerialReporting(byte portId)
+{
+  for (byte i = 0; i < serialIndex + 1; i++) {
+    if (reportSerial[i] == portId) {
+      // shift elements over to fill space left by removed element
+      for (; i < serialIndex; i++) {
+        reportSerial[i] = reportSerial[i + 1];
       }
+      serialIndex--;
       break;
-#endif
+    }
   }
-  return NULL;
 }
 
 // Check serial ports that have READ_CONTINUOUS mode set and relay any data
@@ -266,40 +668,61 @@ void checkSerial()
   int bytesToRead = 0;
   int numBytesToRead = 0;
   Stream* serialPort;
+  serial_port_info *info;
 
   if (serialIndex > -1) {
 
     // loop through all reporting (READ_CONTINUOUS) serial ports
     for (byte i = 0; i < serialIndex + 1; i++) {
       portId = reportSerial[i];
-      bytesToRead = serialBytesToRead[portId];
-      serialPort = getPortFromId(portId);
+      info = &serialPorts[portId];
+      bytesToRead = info->bytesToRead;
+      serialPort = info->stream;
       if (serialPort == NULL) {
         continue;
       }
 #if defined(SoftwareSerial_h)
       // only the SoftwareSerial port that is "listening" can read data
-      if (portId > 7 && !((SoftwareSerial*)serialPort)->isListening()) {
+      if (info->type == SERIAL_PORT_SOFTWARE && !((SoftwareSerial*)serialPort)->isListening()) {
         continue;
       }
 #endif
-      if (serialPort->available() > 0) {
-        Firmata.write(START_SYSEX);
-        Firmata.write(SERIAL_MESSAGE);
-        Firmata.write(SERIAL_REPLY | portId);
-
+      if (info->batch != NULL) {
+        checkSerialBatch(info->batch, serialPort);
+      } else if (serialPort->available() > 0) {
         if (bytesToRead == 0 || (serialPort->available() <= bytesToRead)) {
           numBytesToRead = serialPort->available();
         } else {
           numBytesToRead = bytesToRead;
         }
 
-        // relay serial data to the serial device
-        while (numBytesToRead > 0) {
-          serialData = serialPort->read();
-          Firmata.write(serialData & 0x7F);
-          Firmata.write((serialData >> 7) & 0x7F);
-          numBytesToRead--;
+        // relay what the host link has room for, the rest stays in the port
+        int room = txRoom() - 3;
+        room = info->replyPacked ? room * 7 / 8 : room / 2;
+        if (room < numBytesToRead) {
+          txCounters[TX_DEFERRED_SERIAL]++;
+          if (room <= 0) {
+            continue;
+          }
+          numBytesToRead = room;
+        }
+
+        Firmata.write(START_SYSEX);
+        Firmata.write(SERIAL_MESSAGE);
+        if (info->replyPacked) {
+          // 7 bytes of data take 8 bytes instead of 14
+          Firmata.write(SERIAL_REPLY_PACKED | portId);
+          relaySerialPacked(serialPort, numBytesToRead);
+        } else {
+          Firmata.write(SERIAL_REPLY | portId);
+
+          // relay serial data to the serial device
+          while (numBytesToRead > 0) {
+            serialData = serialPort->read();
+            Firmata.write(serialData & 0x7F);
+            Firmata.write((serialData >> 7) & 0x7F);
+            numBytesToRead--;
+          }
         }
         Firmata.write(END_SYSEX);
       }
@@ -346,15 +769,13 @@ void detachServo(byte pin)
   servoPinMap[pin] = 255;
 }
 
-/**
-   TO-DO
-   ==============
-   Track encoders attaching and detatching, perhaps use a similar method to servos
-
- **/
-
 void attachEncoder(byte encoderNum, byte pinANum, byte pinBNum)
 {
+  if (encoderNum >= MAX_ENCODERS)
+  {
+    Firmata.sendString("Encoder Warning: encoder number out of range. Operation cancelled.");
+    return;
+  }
   if (isEncoderAttached(encoderNum))
   {
     Firmata.sendString("Encoder Warning: encoder is already attached. Operation cancelled.");
@@ -367,26 +788,97 @@ void attachEncoder(byte encoderNum, byte pinANum, byte pinBNum)
   }*/
   setPinModeCallback(pinANum, ENCODER);
   setPinModeCallback(pinBNum, ENCODER);
-  encoders[encoderNum] = Encoder(pinANum, pinBNum);
-  numAttachedEncoders++;
+  // begin() in place: the pin interrupts point at encoders[encoderNum]
+  encoders[encoderNum].begin(pinANum, pinBNum);
+  positions[encoderNum] = 0;
+  prevPositions[encoderNum] = 0;
+  prevVelocities[encoderNum] = 0;
+  attachedEncoders |= ENCODER_SLOT(encoderNum);
+  if (encoders[encoderNum].isPolled())
+  {
+    polledEncoders |= ENCODER_SLOT(encoderNum);
+  }
   reportEncoderPosition(encoderNum);
 }
 
-/**
-   TO-DO
-   ==============
-   How should we detach them? now it just gives it an empty object, need a way to make it null
-
- **/
-
 void detachEncoder(byte encoderNum)
 {
   if (isEncoderAttached(encoderNum))
   {
-    //free(encoders[encoderNum]);
-    encoders[encoderNum] = Encoder();
-    numAttachedEncoders--;
+    encoders[encoderNum].end();
+    attachedEncoders &= ~ENCODER_SLOT(encoderNum);
+    polledEncoders &= ~ENCODER_SLOT(encoderNum);
+  }
+}
+
+/*
+   Start a coordinated move of several steppers. After the subcommand the
+   message holds the number of axes, then for each axis the device number,
+   direction and 21-bit step count (same encoding as STEPPER_STEP), followed
+   by an optional speed, acceleration and deceleration for the longest axis.
+   A single STEPPER_DONE carrying the first listed device is sent when all
+   axes have arrived, right away if none has to move.
+*/
+void moveStepperGroup(byte argc, byte *argv)
+{
+  if (argc < 2 || argv[1] == 0 || argv[1] > STEPPER_GROUP_MAX_AXES || argc < 2 + argv[1] * 5) {
+    Firmata.sendString("Stepper group: invalid axis");
+    return;
   }
+  byte numAxes = argv[1];
+  byte argIndex = 2 + numAxes * 5;
+
+  stepperGroup.clear();
+  for (byte i = 0; i < numAxes; i++) {
+    byte *axis = argv + 2 + i * 5;
+    byte deviceNum = axis[0];
+    long numSteps = (long)axis[2] | ((long)axis[3] << 7) | ((long)axis[4] << 14);
+
+    if (axis[1] == 0) {
+      numSteps *= -1;
+    }
+    if (deviceNum >= MAX_STEPPERS || !stepper[deviceNum] || !stepperGroup.addAxis(stepper[deviceNum], numSteps)) {
+      Firmata.sendString("Stepper group: invalid axis");
+      stepperGroup.clear();
+      return;
+    }
+  }
+  stepperGroupDevice = argv[2];
+
+  bool moving;
+  if (argc >= argIndex + 6) {
+    moving = stepperGroup.start(argv[argIndex] + (argv[argIndex + 1] << 7),
+                                argv[argIndex + 2] + (argv[argIndex + 3] << 7),
+                                argv[argIndex + 4] + (argv[argIndex + 5] << 7));
+  } else if (argc >= argIndex + 2) {
+    moving = stepperGroup.start(argv[argIndex] + (argv[argIndex + 1] << 7));
+  } else {
+    moving = stepperGroup.start();
+  }
+  if (!moving) {
+    Firmata.write(START_SYSEX);
+    Firmata.write(STEPPER_DATA);
+    Firmata.write(STEPPER_DONE);
+    Firmata.write(stepperGroupDevice);
+    Firmata.write(END_SYSEX);
+  }
+}
+
+/*
+   Report how many moves are waiting in a stepper's queue and how many more
+   it can take, so the host can keep it topped up.
+*/
+void reportStepperQueueDepth(byte deviceNum)
+{
+  byte depth = stepper[deviceNum]->getQueueDepth();
+  stepperQueueDepth[deviceNum] = depth;
+  Firmata.write(START_SYSEX);
+  Firmata.write(STEPPER_DATA);
+  Firmata.write(STEPPER_QUEUE_DEPTH);
+  Firmata.write(deviceNum);
+  Firmata.write(depth);
+  Firmata.write(STEPPER_QUEUE_SIZE - depth);
+  Firmata.write(END_SYSEX);
 }
 
 void oneWireConfig(byte pin, boolean power) {
@@ -400,41 +892,328 @@ void oneWireConfig(byte pin, boolean power) {
   info->power = power;
 }
 
-void readAndReportData(byte address, int theRegister, byte numBytes) {
+/*
+   Queue a read of numBytes from a device. The reply is sent by updateI2C()
+   once the transfer has completed in the background.
+*/
+void startI2CRead(byte address, int theRegister, byte numBytes)
+{
+  if (numBytes > sizeof(i2cRxData) - 2) {
+    numBytes = sizeof(i2cRxData) - 2;
+  }
+  i2cTransfer.address = address;
   // allow I2C requests that don't require a register read
   // for example, some devices using an interrupt pin to signify new data available
   // do not always require the register read so upon interrupt you call Wire.requestFrom()
-  if (theRegister != I2C_REGISTER_NOT_SPECIFIED) {
-    Wire.beginTransmission(address);
-    wireWrite((byte)theRegister);
-    Wire.endTransmission();
-    // do not set a value of 0
-    if (i2cReadDelayTime > 0) {
-      // delay is necessary for some devices such as WiiNunchuck
-      delayMicroseconds(i2cReadDelayTime);
+  i2cTransfer.reg = theRegister;
+  // delay is necessary for some devices such as WiiNunchuck
+  i2cTransfer.delay = theRegister != I2C_REGISTER_NOT_SPECIFIED ? i2cReadDelayTime : 0;
+  i2cTransfer.data = i2cRxData + 2;
+  i2cTransfer.length = numBytes;
+  i2cTransfer.flags = 0;
+  I2CQueue.submit(&i2cTransfer);
+}
+
+/*
+   Queue a write of the 7-bit encoded bytes of an I2C_WRITE request. It
+   goes out in the background, in order with the reads, from a copy of the
+   data; updateI2C() reports it if it fails.
+*/
+void startI2CWrite(byte address, byte argc, byte *argv)
+{
+  finishI2CWrites();
+  for (byte i = 0; i < I2C_PENDING_WRITES; i++) {
+    I2CTransfer *transfer = &i2cWrites[i];
+    if (transfer->state == I2C_TRANSFER_IDLE) {
+      byte numBytes = 0;
+      for (byte j = 2; j + 1 < argc && numBytes < I2C_MAX_WRITE; j += 2) {
+        i2cWriteData[i][numBytes++] = argv[j] + (argv[j + 1] << 7);
+      }
+      transfer->address = address;
+      transfer->reg = I2C_NO_REGISTER;
+      transfer->delay = 0;
+      transfer->data = i2cWriteData[i];
+      transfer->length = numBytes;
+      transfer->flags = I2C_TRANSFER_WRITE;
+      I2CQueue.submit(transfer);
+      return;
     }
-  } else {
-    theRegister = 0;  // fill the register with a dummy value
   }
+  Firmata.sendString("I2C: Too many writes waiting");
+}
+
+// Free the writes that have completed, reporting the ones that failed
+void finishI2CWrites()
+{
+  for (byte i = 0; i < I2C_PENDING_WRITES; i++) {
+    byte state = i2cWrites[i].state;
+    if (state == I2C_TRANSFER_DONE || state == I2C_TRANSFER_ERROR) {
+      if (state == I2C_TRANSFER_ERROR) {
+        Firmata.sendString("I2C: Write failed");
+      }
+      i2cWrites[i].state = I2C_TRANSFER_IDLE;
+    }
+  }
+}
+
+// Fletcher-16 checksum, to notice changes in bytes that are not kept
+unsigned int i2cChecksum(byte *data, byte length)
+{
+  unsigned int sum1 = 0;
+  unsigned int sum2 = 0;
+  for (byte i = 0; i < length; i++) {
+    sum1 = (sum1 + data[i]) % 255;
+    sum2 = (sum2 + sum1) % 255;
+  }
+  return (sum2 << 8) | sum1;
+}
 
-  Wire.requestFrom(address, numBytes);  // all bytes are returned in requestFrom
+/*
+   Compare the data just read with the last reply sent for a change-only
+   query. The first I2C_DEADBAND_WORDS 16-bit values must move by more than
+   the deadband, any other byte counts as soon as it changes. The values
+   are remembered when the reply is sent, so slow drift is still reported.
+*/
+boolean i2cDataChanged(i2c_device_info *device, boolean remember)
+{
+  byte *data = i2cRxData + 2;
+  byte numWords = min(i2cTransfer.length / 2, I2C_DEADBAND_WORDS);
+  unsigned int deadband = device->deadband & ~I2C_DEADBAND_LITTLE_ENDIAN;
+  boolean changed = false;
+
+  for (byte i = 0; i < numWords; i++) {
+    int value;
+    if (device->deadband & I2C_DEADBAND_LITTLE_ENDIAN) {
+      value = (int)(data[2 * i] | ((unsigned int)data[2 * i + 1] << 8));
+    } else {
+      value = (int)(((unsigned int)data[2 * i] << 8) | data[2 * i + 1]);
+    }
+    if (abs((long)value - device->lastWords[i]) > deadband) {
+      changed = true;
+    }
+    if (remember) {
+      device->lastWords[i] = value;
+    }
+  }
+  unsigned int sum = i2cChecksum(data + 2 * numWords, i2cTransfer.length - 2 * numWords);
+  if (sum != device->lastSum) {
+    changed = true;
+  }
+  if (remember) {
+    device->lastSum = sum;
+  }
+  return changed;
+}
 
+void reportI2CData()
+{
   // check to be sure correct number of bytes were returned by slave
-  if (numBytes < Wire.available()) {
-    Firmata.sendString("I2C: Too many bytes received");
-  } else if (numBytes > Wire.available()) {
+  if (i2cTransfer.count < i2cTransfer.length) {
     Firmata.sendString("I2C: Too few bytes received");
   }
+  else if (i2cTransferIsQuery) {
+    // the next read brings fresh data, so the reply can be dropped
+    if (txRoom() < 2 * (i2cTransfer.length + 2) + 3) {
+      txCounters[TX_DROPPED_I2C]++;
+      return;
+    }
+    byte index = findI2CQuery(i2cTransfer.address, i2cTransfer.reg);
+    if (index != I2C_NO_QUERY && query[index].changeOnly) {
+      i2c_device_info *device = &query[index];
+      // skip unchanged replies, but send one every keepalive so the host
+      // knows the device is still read
+      if (millis() - device->lastReport < device->keepalive && !i2cDataChanged(device, false)) {
+        return;
+      }
+      i2cDataChanged(device, true);
+      device->lastReport = millis();
+    }
+  }
 
-  i2cRxData[0] = address;
-  i2cRxData[1] = theRegister;
+  i2cRxData[0] = i2cTransfer.address;
+  // fill the register with a dummy value if none was read
+  i2cRxData[1] = i2cTransfer.reg != I2C_REGISTER_NOT_SPECIFIED ? i2cTransfer.reg : 0;
 
-  for (int i = 0; i < numBytes && Wire.available(); i++) {
-    i2cRxData[2 + i] = wireRead();
+  // send slave address, register and received bytes
+  Firmata.sendSysex(SYSEX_I2C_REPLY, i2cTransfer.length + 2, i2cRxData);
+}
+
+// Index of the continuous read of a device register, or I2C_NO_QUERY
+byte findI2CQuery(byte address, int theRegister)
+{
+  for (byte i = 0; i < i2cQueryCount; i++) {
+    if (query[i].addr == address && query[i].reg == theRegister) {
+      return i;
+    }
   }
+  return I2C_NO_QUERY;
+}
 
-  // send slave address, register and received bytes
-  Firmata.sendSysex(SYSEX_I2C_REPLY, numBytes + 2, i2cRxData);
+// Remove a continuous read by moving the last one into its place
+void removeI2CQuery(byte index)
+{
+  i2cQueryCount--;
+  if (index < i2cQueryCount) {
+    query[index] = query[i2cQueryCount];
+  }
+}
+
+// Find the earliest due time of the continuous reads
+void updateI2CNextDue()
+{
+  for (byte i = 0; i < i2cQueryCount; i++) {
+    if (i == 0 || (long)(query[i].due - i2cNextDue) < 0) {
+      i2cNextDue = query[i].due;
+    }
+  }
+}
+
+/*
+   Start the continuous read that is the most overdue, if any, and set its
+   next due time one period later. A read that fell more than a period
+   behind skips ahead instead of catching up in a burst.
+*/
+void startDueI2CQuery()
+{
+  unsigned long now = millis();
+  byte next = I2C_NO_QUERY;
+  long late = 0;
+
+  if (i2cQueryCount == 0 || (long)(now - i2cNextDue) < 0) {
+    return;
+  }
+  for (byte i = 0; i < i2cQueryCount; i++) {
+    long queryLate = now - query[i].due;
+    if (queryLate >= 0 && (next == I2C_NO_QUERY || queryLate > late)) {
+      next = i;
+      late = queryLate;
+    }
+  }
+  if (next == I2C_NO_QUERY) {
+    return;
+  }
+
+  i2c_device_info *device = &query[next];
+  unsigned int period = device->period > 0 ? device->period : samplingInterval;
+  startI2CRead(device->addr, device->reg, device->bytes);
+  i2cTransferIsQuery = true;
+  device->due += period;
+  if ((long)(now - device->due) >= 0) {
+    device->due = now + period;
+  }
+  updateI2CNextDue();
+}
+
+/*
+   Reply to the last read once it has completed, then start the next one:
+   a pending I2C_READ first, then the continuous read that is due soonest.
+*/
+void updateI2C()
+{
+  I2CQueue.update();
+  finishI2CWrites();
+  if (i2cBurstReads > 0) {
+    updateI2CBurst();
+  }
+  if (i2cTransfer.state == I2C_TRANSFER_DONE || i2cTransfer.state == I2C_TRANSFER_ERROR) {
+    reportI2CData();
+    i2cTransfer.state = I2C_TRANSFER_IDLE;
+  }
+  if (i2cTransfer.state != I2C_TRANSFER_IDLE) {
+    return;
+  }
+
+  if (i2cPendingReadCount > 0) {
+    i2c_read_request request = i2cPendingReads[0];
+    i2cPendingReadCount--;
+    memmove(i2cPendingReads, i2cPendingReads + 1, i2cPendingReadCount * sizeof(i2c_read_request));
+    startI2CRead(request.addr, request.reg, request.bytes);
+    i2cTransferIsQuery = false;
+  }
+  else {
+    startDueI2CQuery();
+  }
+}
+
+/*
+   Queue the reads of an I2C_BURST_REQUEST. Each read takes 4 bytes: the
+   address, the 14-bit register (0x3FFF for none) and the byte count. The
+   reads run back to back from the I2C interrupt and are answered with a
+   single I2C_BURST_REQUEST reply holding, for each read, the address, the
+   register, the byte count and the data (each byte as two 7-bit bytes, as
+   in SYSEX_I2C_REPLY). Only one burst runs at a time, another one is
+   refused until its reply has gone.
+*/
+void startI2CBurst(byte argc, byte *argv)
+{
+  byte numReads = argc / 4;
+  byte offset = 0;
+
+  if (numReads == 0 || numReads > I2C_BURST_MAX_READS) {
+    Firmata.sendString("I2C: Bad burst read");
+    return;
+  }
+  if (i2cBurstReads > 0) {
+    Firmata.sendString("I2C: Burst read busy");
+    return;
+  }
+
+  for (byte i = 0; i < numReads; i++) {
+    byte *read = argv + i * 4;
+    int theRegister = read[1] + (read[2] << 7);
+    byte numBytes = read[3];
+
+    // the reply waits for room on the link, so it must fit in it
+    if (offset + 3 + numBytes > I2C_BURST_SIZE || 2 * (offset + 3 + numBytes) + 3 > TX_ROOM_MAX) {
+      Firmata.sendString("I2C: Burst read too long");
+      return;
+    }
+    if (theRegister == I2C_REGISTER_NONE_14BIT) {
+      theRegister = I2C_REGISTER_NOT_SPECIFIED;
+    }
+    i2cBurstData[offset] = read[0];
+    i2cBurstData[offset + 1] = theRegister != I2C_REGISTER_NOT_SPECIFIED ? theRegister : 0;
+    i2cBurstData[offset + 2] = numBytes;
+
+    I2CTransfer *transfer = &i2cBurst[i];
+    transfer->address = read[0];
+    transfer->reg = theRegister;
+    transfer->delay = theRegister != I2C_REGISTER_NOT_SPECIFIED ? i2cReadDelayTime : 0;
+    transfer->data = i2cBurstData + offset + 3;
+    transfer->length = numBytes;
+    transfer->flags = 0;
+    offset += 3 + numBytes;
+  }
+
+  i2cBurstReads = numReads;
+  for (byte i = 0; i < numReads; i++) {
+    I2CQueue.submit(&i2cBurst[i]);
+  }
+}
+
+// Send the burst reply once all of its reads are complete and the link has room for it
+void updateI2CBurst()
+{
+  byte length = 0;
+  boolean failed = false;
+
+  for (byte i = 0; i < i2cBurstReads; i++) {
+    if (i2cBurst[i].state == I2C_TRANSFER_QUEUED || i2cBurst[i].state == I2C_TRANSFER_BUSY) {
+      return;
+    }
+    if (i2cBurst[i].count < i2cBurst[i].length) {
+      failed = true;
+    }
+    length += 3 + i2cBurst[i].length;
+  }
+  if (txRoom() < 2 * length + 3) {
+    return;
+  }
+  if (failed) {
+    Firmata.sendString("I2C: Too few bytes received");
+  }
+  Firmata.sendSysex(I2C_BURST_REQUEST, length, i2cBurstData);
+  i2cBurstReads = 0;
 }
 
 void outputPort(byte portNumber, byte portValue, byte forceSend)
@@ -474,6 +1253,21 @@ void checkDigitalInputs(void)
   if (TOTAL_PORTS > 15 && reportPINs[15]) outputPort(15, readPort(15, portConfigInputs[15]), false);
 }
 
+// -----------------------------------------------------------------------------
+/* true for a PWM pin driven by Timer2 while the steppers own Timer2, PWM
+   on it would change the stepper tick
+*/
+boolean isStepperTimerPin(byte pin)
+{
+#ifdef STEPPER_USE_TIMER
+  if (numSteppers > 0 && IS_PIN_PWM(pin)) {
+    byte timer = digitalPinToTimer(PIN_TO_PWM(pin));
+    return timer == TIMER2 || timer == TIMER2A || timer == TIMER2B;
+  }
+#endif
+  return false;
+}
+
 // -----------------------------------------------------------------------------
 /* sets the pin mode to the correct state and sets the relevant bits in the
    two bit-arrays that track Digital I/O and PWM status
@@ -542,7 +1336,7 @@ void setPinModeCallback(byte pin, int mode)
       }
       break;
     case PIN_MODE_PWM:
-      if (IS_PIN_PWM(pin)) {
+      if (IS_PIN_PWM(pin) && !isStepperTimerPin(pin)) {
         pinMode(PIN_TO_PWM(pin), OUTPUT);
         analogWrite(PIN_TO_PWM(pin), 0);
         pinConfig[pin] = PIN_MODE_PWM;
@@ -619,7 +1413,7 @@ void analogWriteCallback(byte pin, int value)
         pinState[pin] = value;
         break;
       case PIN_MODE_PWM:
-        if (IS_PIN_PWM(pin))
+        if (IS_PIN_PWM(pin) && !isStepperTimerPin(pin))
           analogWrite(PIN_TO_PWM(pin), value);
         pinState[pin] = value;
         break;
@@ -675,8 +1469,9 @@ void reportAnalogCallback(byte analogPin, int value)
     } else {
       analogInputsToReport = analogInputsToReport | (1 << analogPin);
       // prevent during system reset or all analog pin values will be reported
-      // which may report noise for unconnected analog pins
-      if (!isResetting) {
+      // which may report noise for unconnected analog pins; while the analog
+      // stream runs the ADC is taken and the stream carries the values
+      if (!isResetting && !AnalogStream.isRunning()) {
         // Send pin value immediately. This is helpful when connected via
         // ethernet, wi-fi or bluetooth so pin states can be known upon
         // reconnecting.
@@ -729,13 +1524,7 @@ void sysexCallback(byte command, byte argc, byte *argv)
 
       switch (mode) {
         case I2C_WRITE:
-          Wire.beginTransmission(slaveAddress);
-          for (byte i = 2; i < argc; i += 2) {
-            data = argv[i] + (argv[i + 1] << 7);
-            wireWrite(data);
-          }
-          Wire.endTransmission();
-          delayMicroseconds(70);
+          startI2CWrite(slaveAddress, argc, argv);
           break;
         case I2C_READ:
           if (argc == 6) {
@@ -748,60 +1537,133 @@ void sysexCallback(byte command, byte argc, byte *argv)
             slaveRegister = I2C_REGISTER_NOT_SPECIFIED;
             data = argv[2] + (argv[3] << 7);  // bytes to read
           }
-          readAndReportData(slaveAddress, (int)slaveRegister, data);
-          break;
-        case I2C_READ_CONTINUOUSLY:
-          if ((queryIndex + 1) >= I2C_MAX_QUERIES) {
-            // too many queries, just PIN_MODE_IGNORE
-            Firmata.sendString("too many queries");
+          // the reads wait their turn for the bus, updateI2C() replies
+          if (i2cPendingReadCount >= I2C_PENDING_READS) {
+            Firmata.sendString("I2C: Too many reads waiting");
             break;
           }
-          if (argc == 6) {
+          i2cPendingReads[i2cPendingReadCount].addr = slaveAddress;
+          i2cPendingReads[i2cPendingReadCount].reg = slaveRegister;
+          i2cPendingReads[i2cPendingReadCount].bytes = data;
+          i2cPendingReadCount++;
+          updateI2C();
+          break;
+        case I2C_READ_CONTINUOUSLY:
+          if (argc >= 6) {
             // a slave register is specified
             slaveRegister = argv[2] + (argv[3] << 7);
             data = argv[4] + (argv[5] << 7);  // bytes to read
+            if (slaveRegister == I2C_REGISTER_NONE_14BIT) {
+              slaveRegister = (int)I2C_REGISTER_NOT_SPECIFIED;
+            }
           }
           else {
             // a slave register is NOT specified
             slaveRegister = (int)I2C_REGISTER_NOT_SPECIFIED;
             data = argv[2] + (argv[3] << 7);  // bytes to read
           }
-          queryIndex++;
-          query[queryIndex].addr = slaveAddress;
-          query[queryIndex].reg = slaveRegister;
-          query[queryIndex].bytes = data;
-          break;
-        case I2C_STOP_READING:
-          byte queryIndexToSkip;
-          // if read continuous mode is enabled for only 1 i2c device, disable
-          // read continuous reporting for that device
-          if (queryIndex <= 0) {
-            queryIndex = -1;
-          } else {
-            // if read continuous mode is enabled for multiple devices,
-            // determine which device to stop reading and remove it's data from
-            // the array, shifiting other array data to fill the space
-            for (byte i = 0; i < queryIndex + 1; i++) {
-              if (query[i].addr == slaveAddress) {
-                queryIndexToSkip = i;
+          {
+            // the replies are dropped while the link is behind, so one
+            // must fit in the room the link has once it has caught up
+            if (2 * (min(data, I2C_MAX_READ) + 2) + 3 > TX_ROOM_MAX) {
+              Firmata.sendString("I2C: Continuous read too long");
+              break;
+            }
+            // reading the same register again only updates the query
+            byte index = findI2CQuery(slaveAddress, slaveRegister);
+            if (index == I2C_NO_QUERY) {
+              if (i2cQueryCount >= I2C_MAX_QUERIES) {
+                // too many queries, just PIN_MODE_IGNORE
+                Firmata.sendString("too many queries");
                 break;
               }
+              index = i2cQueryCount++;
             }
-
-            for (byte i = queryIndexToSkip; i < queryIndex + 1; i++) {
-              if (i < I2C_MAX_QUERIES) {
-                query[i].addr = query[i + 1].addr;
-                query[i].reg = query[i + 1].reg;
-                query[i].bytes = query[i + 1].bytes;
+            i2c_device_info *device = &query[index];
+            device->addr = slaveAddress;
+            device->reg = slaveRegister;
+            device->bytes = data;
+            // an optional read period in ms follows the byte count
+            device->period = argc >= 8 ? argv[6] + (argv[7] << 7) : 0;
+            // offset the first read so queries added together do not all
+            // fall due at the same time
+            device->due = millis() + (unsigned long)(device->period > 0 ?
+                          device->period : samplingInterval) * index / I2C_MAX_QUERIES;
+            // then optional change-only replies: a deadband and a keepalive in ms
+            device->changeOnly = argc >= 10;
+            if (device->changeOnly) {
+              device->deadband = argv[8] + (argv[9] << 7);
+              device->keepalive = argc >= 12 ? argv[10] + (argv[11] << 7) : 0;
+              if (device->keepalive == 0) {
+                device->keepalive = I2C_DEFAULT_KEEPALIVE;
+              }
+              // the first read is always sent
+              device->lastReport = millis() - device->keepalive;
+            }
+          }
+          updateI2CNextDue();
+          break;
+        case I2C_STOP_READING:
+          if (argc >= 4) {
+            // stop reading one register
+            slaveRegister = argv[2] + (argv[3] << 7);
+            if (slaveRegister == I2C_REGISTER_NONE_14BIT) {
+              slaveRegister = (int)I2C_REGISTER_NOT_SPECIFIED;
+            }
+            byte index = findI2CQuery(slaveAddress, slaveRegister);
+            if (index != I2C_NO_QUERY) {
+              removeI2CQuery(index);
+            }
+          }
+          else {
+            // stop reading every register of the device
+            for (byte i = i2cQueryCount; i-- > 0;) {
+              if (query[i].addr == slaveAddress) {
+                removeI2CQuery(i);
               }
             }
-            queryIndex--;
           }
+          updateI2CNextDue();
           break;
         default:
           break;
       }
       break;
+    case I2C_BURST_REQUEST:
+      startI2CBurst(argc, argv);
+      break;
+    case TX_STATS_QUERY:
+      reportTxStats(argc, argv);
+      break;
+    case SAMPLING_STATS_QUERY:
+      reportSamplingStats(argc, argv);
+      break;
+    case ANALOG_BLOCK:
+      if (argc > 0) {
+        analogBlocks = argv[0] == 1;
+        analogBlockSeq = 0;
+        analogBlockSync = true;
+      }
+      break;
+    case ANALOG_STREAM:
+      if (argc > 3 && argv[0] == 1) {
+        unsigned int mask = (unsigned int)argv[1] | ((unsigned int)argv[2] << 7) | ((unsigned int)argv[3] << 14);
+#if TOTAL_ANALOG_PINS < 16
+        mask &= (1 << TOTAL_ANALOG_PINS) - 1;
+#endif
+        if ((mask & analogModePins()) != mask) {
+          Firmata.sendString("Analog streaming: pin not in ANALOG mode");
+          break;
+        }
+        analogStreamSeq = 0;
+        if (!AnalogStream.begin(mask, argc > 4 ? argv[4] : 7, argc > 5 ? argv[5] : 1)) {
+          Firmata.sendString("Analog streaming not supported");
+        }
+      } else if (argc > 0 && argv[0] == 0 && AnalogStream.isRunning()) {
+        AnalogStream.end();
+        reportAnalogStream(true);
+      }
+      break;
     case I2C_CONFIG:
       delayTime = (argv[0] + (argv[1] << 7));
 
@@ -813,6 +1675,14 @@ void sysexCallback(byte command, byte argc, byte *argv)
         enableI2CPins();
       }
 
+      // an optional bus clock in kHz follows the delay
+      if (argc >= 4) {
+        long clock = argv[2] + (argv[3] << 7);
+        if (clock > 0 && !I2CQueue.setClock(clock * 1000)) {
+          Firmata.sendString("I2C: Clock out of range");
+        }
+      }
+
       break;
     case SERVO_CONFIG:
       if (argc > 4) {
@@ -844,7 +1714,11 @@ void sysexCallback(byte command, byte argc, byte *argv)
       stepCommand = argv[0];
       deviceNum = argv[1];
 
-      if (deviceNum < MAX_STEPPERS)
+      if (stepCommand == STEPPER_GROUP_MOVE)
+      {
+        moveStepperGroup(argc, argv);
+      }
+      else if (deviceNum < MAX_STEPPERS)
       {
         if (stepCommand == STEPPER_CONFIG)
         {
@@ -860,6 +1734,22 @@ void sysexCallback(byte command, byte argc, byte *argv)
           if (!stepper[deviceNum])
           {
             numSteppers++; // assumes steppers are added in order 0 -> 5
+            // PWM on the Timer2 pins stops once the steppers take the timer
+            for (byte pin = 0; pin < TOTAL_PINS; pin++) {
+              if (pinConfig[pin] == PIN_MODE_PWM && isStepperTimerPin(pin)) {
+                setPinModeCallback(pin, OUTPUT);
+              }
+            }
+          }
+          else
+          {
+            if (stepperGroup.contains(stepper[deviceNum]))
+            {
+              stepperGroup.clear();
+            }
+            // release the previous instance (and its timer slot) before reconfiguring
+            delete stepper[deviceNum];
+            stepper[deviceNum] = 0;
           }
 
           if (interfaceType == Stepper::DRIVER || interfaceType == Stepper::TWO_WIRE)
@@ -910,7 +1800,7 @@ void sysexCallback(byte command, byte argc, byte *argv)
             }
           }
         }
-        else if (stepCommand == STEPPER_STEP)
+        else if (stepCommand == STEPPER_STEP || stepCommand == STEPPER_QUEUE_STEP)
         {
           stepDirection = argv[2];
           numSteps = (long)argv[3] | ((long)argv[4] << 7) | ((long)argv[5] << 14);
@@ -919,26 +1809,52 @@ void sysexCallback(byte command, byte argc, byte *argv)
           {
             numSteps *= -1;
           }
-          if (stepper[deviceNum])
+          // only a new move on the group leader ends the coordinated move
+          if (stepperGroup.isFollower(stepper[deviceNum]) ||
+              (stepCommand == STEPPER_QUEUE_STEP && stepperGroup.isLeader(stepper[deviceNum])))
+          {
+            Firmata.sendString("Stepper group busy");
+          }
+          else if (stepper[deviceNum])
           {
-            if (argc < 8)
+            if (stepperGroup.isLeader(stepper[deviceNum]))
             {
-              stepper[deviceNum]->setStepsToMove(numSteps);
+              stepperGroup.clear();
             }
-            if (argc >= 8 && argc < 12)
+            // -1 keeps the stepper's current value
+            stepSpeed = -1;
+            accel = -1;
+            decel = -1;
+            if (argc >= 8)
             {
-              stepSpeed = (argv[6] + (argv[7] << 7));
               // num steps, speed (0.01*rad/sec)
-              stepper[deviceNum]->setStepsToMove(numSteps, stepSpeed);
+              stepSpeed = (argv[6] + (argv[7] << 7));
             }
-            else if (argc == 12)
+            if (argc >= 12)
             {
-              stepSpeed = (argv[6] + (argv[7] << 7));
+              // num steps, speed (0.01*rad/sec), accel (0.01*rad/sec^2), decel (0.01*rad/sec^2)
               accel = (argv[8] + (argv[9] << 7));
               decel = (argv[10] + (argv[11] << 7));
-              // num steps, speed (0.01*rad/sec), accel (0.01*rad/sec^2), decel (0.01*rad/sec^2)
+            }
+            if (stepCommand == STEPPER_STEP)
+            {
               stepper[deviceNum]->setStepsToMove(numSteps, stepSpeed, accel, decel);
             }
+            else
+            {
+              if (!stepper[deviceNum]->queueMove(numSteps, stepSpeed, accel, decel))
+              {
+                Firmata.sendString("Stepper queue full");
+              }
+              reportStepperQueueDepth(deviceNum);
+            }
+          }
+        }
+        else if (stepCommand == STEPPER_QUEUE_DEPTH)
+        {
+          if (stepper[deviceNum])
+          {
+            reportStepperQueueDepth(deviceNum);
           }
         }
         else if (stepCommand == STEPPER_GET_POSITION)
@@ -990,8 +1906,17 @@ void sysexCallback(byte command, byte argc, byte *argv)
           int newDecel = (argv[2] + (argv[3] << 7));
           stepper[deviceNum]->setDeceleration(newDecel);
         }
+        else if (stepperGroup.isFollower(stepper[deviceNum]) &&
+                 (stepCommand == STEPPER_HOME || stepCommand == STEPPER_SET_HOME))
+        {
+          Firmata.sendString("Stepper group busy");
+        }
         else if (stepCommand == STEPPER_HOME)
         {
+          if (stepperGroup.isLeader(stepper[deviceNum]))
+          {
+            stepperGroup.clear();
+          }
           stepper[deviceNum]->home();
         }
         else if (stepCommand == STEPPER_SET_HOME)
@@ -1025,7 +1950,7 @@ void sysexCallback(byte command, byte argc, byte *argv)
 
       if (encoderCommand == ENCODER_REPORT_POSITIONS)
       {
-        reportEncoderPositions();
+        reportEncoderPositions(false);
       }
 
       if (encoderCommand == ENCODER_RESET_POSITION)
@@ -1036,6 +1961,12 @@ void sysexCallback(byte command, byte argc, byte *argv)
       if (encoderCommand == ENCODER_REPORT_AUTO)
       {
         reportEncoders = argv[1];
+        if (argc > 2 && argv[2] > 0)
+        {
+          encoderKeyframeInterval = argv[2];
+        }
+        // start a delta stream from a known position
+        encoderKeyframeCount = encoderKeyframeInterval;
       }
 
       if (encoderCommand == ENCODER_DETACH)
@@ -1043,6 +1974,12 @@ void sysexCallback(byte command, byte argc, byte *argv)
         encoderNum = argv[1];
         detachEncoder(encoderNum);
       }
+
+      if (encoderCommand == ENCODER_REPORT_VELOCITY)
+      {
+        encoderNum = argv[1];
+        reportEncoderVelocity(encoderNum);
+      }
       break;
     case ONEWIRE_DATA:
       {
@@ -1150,10 +2087,18 @@ void sysexCallback(byte command, byte argc, byte *argv)
       break;
     case SAMPLING_INTERVAL:
       if (argc > 1) {
-        samplingInterval = argv[0] + (argv[1] << 7);
-        if (samplingInterval < MINIMUM_SAMPLING_INTERVAL) {
-          samplingInterval = MINIMUM_SAMPLING_INTERVAL;
+        // optional micros added to the interval in ms, for rates that are
+        // not a whole number of ms
+        unsigned long period = (argv[0] + (argv[1] << 7)) * 1000UL;
+        if (argc > 3) {
+          period += argv[2] + (argv[3] << 7);
+        }
+        if (period < MINIMUM_SAMPLING_INTERVAL * 1000UL) {
+          period = MINIMUM_SAMPLING_INTERVAL * 1000UL;
         }
+        samplingInterval = period / 1000;
+        scheduler.setPeriod(samplingTaskId, period);
+        clearSamplingStats();
       } else {
         //Firmata.sendString("Not enough data");
       }
@@ -1182,7 +2127,7 @@ void sysexCallback(byte command, byte argc, byte *argv)
           Firmata.write(PIN_MODE_ANALOG);
           Firmata.write(10); // 10 = 10-bit resolution
         }
-        if (IS_PIN_PWM(pin)) {
+        if (IS_PIN_PWM(pin) && !isStepperTimerPin(pin)) {
           Firmata.write(PIN_MODE_PWM);
           Firmata.write(8); // 8 = 8-bit resolution
         }
@@ -1244,6 +2189,9 @@ void sysexCallback(byte command, byte argc, byte *argv)
       Stream * serialPort;
       mode = argv[0] & SERIAL_MODE_MASK;
       byte portId = argv[0] & SERIAL_PORT_ID_MASK;
+      if (portId >= SERIAL_READ_ARR_LEN) {
+        break;
+      }
 
       switch (mode) {
         case SERIAL_CONFIG:
@@ -1272,33 +2220,13 @@ void sysexCallback(byte command, byte argc, byte *argv)
               }
             } else {
 #if defined(SoftwareSerial_h)
-              switch (portId) {
-                case SW_SERIAL0:
-                  if (swSerial0 == NULL) {
-                    swSerial0 = new SoftwareSerial(rxPin, txPin);
-                  }
-                  break;
-                case SW_SERIAL1:
-                  if (swSerial1 == NULL) {
-                    swSerial1 = new SoftwareSerial(rxPin, txPin);
-                  }
-                  break;
-                case SW_SERIAL2:
-                  if (swSerial2 == NULL) {
-                    swSerial2 = new SoftwareSerial(rxPin, txPin);
-                  }
-                  break;
-                case SW_SERIAL3:
-                  if (swSerial3 == NULL) {
-                    swSerial3 = new SoftwareSerial(rxPin, txPin);
-                  }
-                  break;
-              }
-              serialPort = getPortFromId(portId);
-              if (serialPort != NULL) {
+              if (portId >= SW_SERIAL0 && portId < SW_SERIAL0 + SERIAL_SW_PORTS && argc > 5) {
+                SoftwareSerial *swSerial = openSoftwareSerial(portId, rxPin, txPin);
+                serialPorts[portId].stream = swSerial;
+                serialPorts[portId].type = SERIAL_PORT_SOFTWARE;
                 setPinModeCallback(rxPin, PIN_MODE_SERIAL);
                 setPinModeCallback(txPin, PIN_MODE_SERIAL);
-                ((SoftwareSerial*)serialPort)->begin(baud);
+                swSerial->begin(baud);
               }
 #endif
             }
@@ -1318,53 +2246,68 @@ void sysexCallback(byte command, byte argc, byte *argv)
             break; // SERIAL_WRITE
           }
         case SERIAL_READ:
-          if (argv[1] == SERIAL_READ_CONTINUOUSLY) {
-            if (serialIndex + 1 >= MAX_SERIAL_PORTS) {
+          if ((argv[1] & ~SERIAL_READ_PACKED) == SERIAL_READ_CONTINUOUSLY) {
+            serial_port_info *info = &serialPorts[portId];
+            boolean reporting = false;
+            for (byte i = 0; i < serialIndex + 1; i++) {
+              if (reportSerial[i] == portId) {
+                reporting = true;
+                break;
+              }
+            }
+            if (!reporting && serialIndex + 1 >= MAX_SERIAL_PORTS) {
               break;
             }
 
+            info->replyPacked = (argv[1] & SERIAL_READ_PACKED) != 0;
+
             if (argc > 2) {
               // maximum number of bytes to read from buffer per iteration of loop()
-              serialBytesToRead[portId] = (int)argv[2] | ((int)argv[3] << 7);
+              info->bytesToRead = (int)argv[2] | ((int)argv[3] << 7);
             } else {
               // read all available bytes per iteration of loop()
-              serialBytesToRead[portId] = 0;
+              info->bytesToRead = 0;
             }
-            serialIndex++;
-            reportSerial[serialIndex] = portId;
-          } else if (argv[1] == SERIAL_STOP_READING) {
-            byte serialIndexToSkip;
-            if (serialIndex <= 0) {
-              serialIndex = -1;
-            } else {
-              for (byte i = 0; i < serialIndex + 1; i++) {
-                if (reportSerial[i] == portId) {
-                  serialIndexToSkip = i;
-                  break;
-                }
-              }
-              // shift elements over to fill space left by removed element
-              for (byte i = serialIndexToSkip; i < serialIndex + 1; i++) {
-                if (i < MAX_SERIAL_PORTS) {
-                  reportSerial[i] = reportSerial[i + 1];
-                }
+
+            // a delimiter and an idle time in ms after the byte count hold
+            // the bytes back and send them in batches of up to that count
+            releaseSerialBatch(portId);
+            if (argc > 5) {
+              serial_batch *batch = findSerialBatch(-1);
+              if (batch == NULL) {
+                Firmata.sendString("Serial: too many batched ports");
+              } else {
+                int size = info->bytesToRead;
+                info->batch = batch;
+                batch->portId = portId;
+                batch->delimiter = (int)argv[4] | ((int)argv[5] << 7);
+                batch->idleTime = argc > 7 ? (int)argv[6] | ((int)argv[7] << 7) : 0;
+                batch->size = size > 0 && size < SERIAL_BATCH_SIZE ? size : SERIAL_BATCH_SIZE;
+                batch->count = 0;
               }
-              serialIndex--;
             }
+            if (!reporting) {
+              serialIndex++;
+              reportSerial[serialIndex] = portId;
+            }
+          } else if (argv[1] == SERIAL_STOP_READING) {
+            releaseSerialBatch(portId);
+            stopSerialReporting(portId);
           }
           break; // SERIAL_READ
         case SERIAL_CLOSE:
           serialPort = getPortFromId(portId);
           if (serialPort != NULL) {
-            if (portId < 8) {
+            releaseSerialBatch(portId);
+            stopSerialReporting(portId);
+            if (serialPorts[portId].type == SERIAL_PORT_HARDWARE) {
               ((HardwareSerial*)serialPort)->end();
             } else {
 #if defined(SoftwareSerial_h)
+              // the instance is kept for the next SERIAL_CONFIG
               ((SoftwareSerial*)serialPort)->end();
-              if (serialPort != NULL) {
-                free(serialPort);
-                serialPort = NULL;
-              }
+              serialPorts[portId].stream = NULL;
+              serialPorts[portId].type = SERIAL_PORT_NONE;
 #endif
             }
           }
@@ -1372,13 +2315,13 @@ void sysexCallback(byte command, byte argc, byte *argv)
         case SERIAL_FLUSH:
           serialPort = getPortFromId(portId);
           if (serialPort != NULL) {
-            getPortFromId(portId)->flush();
+            serialPort->flush();
           }
           break; // SERIAL_FLUSH
 #if defined(SoftwareSerial_h)
         case SERIAL_LISTEN:
           // can only call listen() on software serial ports
-          if (portId > 7) {
+          if (serialPorts[portId].type == SERIAL_PORT_SOFTWARE) {
             serialPort = getPortFromId(portId);
             if (serialPort != NULL) {
               ((SoftwareSerial*)serialPort)->listen();
@@ -1405,14 +2348,15 @@ void enableI2CPins()
 
   isI2CEnabled = true;
 
-  Wire.begin();
+  I2CQueue.begin();
 }
 
 /* disable the i2c pins so they can be used for other functions */
 void disableI2CPins() {
   isI2CEnabled = false;
   // disable read continuous mode for all devices
-  queryIndex = -1;
+  i2cQueryCount = 0;
+  i2cPendingReadCount = 0;
 }
 
 void resetEncoderPosition(byte encoderNum)
@@ -1423,50 +2367,138 @@ void resetEncoderPosition(byte encoderNum)
   }
 }
 
+// Send the bytes packed by one of the EncoderReport functions
+void writeEncoderBytes(byte *data, byte count)
+{
+  for (byte i = 0; i < count; i++)
+  {
+    Firmata.write(data[i]);
+  }
+}
+
+// Write the sign/encoder byte and the 28-bit absolute position of an encoder
+void writeEncoderPosition(byte encoder)
+{
+  byte data[ENCODER_POSITION_BYTES];
+  prevPositions[encoder] = positions[encoder];
+  writeEncoderBytes(data, packEncoderPosition(encoder, positions[encoder], data));
+}
+
+// Copy the positions counted by the encoder interrupts, just before a report
+void readEncoderPositions()
+{
+  for (ENCODER_SLOT_TYPE slots = attachedEncoders; slots; slots &= slots - 1)
+  {
+    byte encoderNum = ENCODER_FIRST_SLOT(slots);
+    positions[encoderNum] = encoders[encoderNum].read();
+  }
+}
+
 // Report specific encoder position using midi protocol
 void reportEncoderPosition(byte encoder)
 {
   if (isEncoderAttached(encoder))
   {
+    positions[encoder] = encoders[encoder].read();
     Firmata.write(START_SYSEX);
     Firmata.write(ENCODER_DATA);
-    long absValue = abs(positions[encoder]);
-    byte direction = positions[encoder] >= 0 ? 0x00 : 0x01;
-    Firmata.write((direction << 6) | (encoder));
-    Firmata.write((byte)absValue & 0x7F);
-    Firmata.write((byte)(absValue >> 7) & 0x7F);
-    Firmata.write((byte)(absValue >> 14) & 0x7F);
-    Firmata.write((byte)(absValue >> 21) & 0x7F);
+    writeEncoderPosition(encoder);
     Firmata.write(END_SYSEX);
   }
 }
 
 // Report all attached encoders positions (one message for all encoders)
-void reportEncoderPositions()
+// only the encoders that moved are sent, unless all is set
+void reportEncoderPositions(bool all)
 {
   bool report = false;
-  for (uint8_t encoderNum = 0; encoderNum < MAX_ENCODERS; encoderNum++)
+  readEncoderPositions();
+  for (ENCODER_SLOT_TYPE slots = attachedEncoders; slots; slots &= slots - 1)
   {
-    if (isEncoderAttached(encoderNum))
+    byte encoderNum = ENCODER_FIRST_SLOT(slots);
+    if (all || positions[encoderNum] != prevPositions[encoderNum])
     {
-      if (positions[encoderNum] != prevPositions[encoderNum])
+      if (!report)
       {
-        if (!report)
-        {
-          Firmata.write(START_SYSEX);
-          Firmata.write(ENCODER_DATA);
-          report = true;
-        }
+        Firmata.write(START_SYSEX);
+        Firmata.write(ENCODER_DATA);
+        report = true;
+      }
+      writeEncoderPosition(encoderNum);
+    }
+  }
+  if (report)
+  {
+    Firmata.write(END_SYSEX);
+  }
+}
+
+// Write a signed value as 28-bit two's complement, 7 bits at a time
+void writeEncoderLong(int32_t value)
+{
+  byte data[ENCODER_LONG_BYTES];
+  writeEncoderBytes(data, packEncoderLong(value, data));
+}
+
+/*
+   Write the position of an encoder (as in the absolute report), its speed
+   in counts per second and the low 28 bits of micros() at its last count.
+   The speed comes from the time between counts, so it stays accurate at
+   low speed whatever the sampling interval.
+*/
+void writeEncoderVelocity(byte encoder)
+{
+  int32_t velocity = encoders[encoder].readVelocity();
+  prevVelocities[encoder] = velocity;
+  writeEncoderPosition(encoder);
+  writeEncoderLong(velocity);
+  writeEncoderLong(encoders[encoder].readEdgeTime());
+}
+
+// Encoders time their counts from the first velocity report asked of them
+void captureEncoderTime(byte encoder)
+{
+  if (!encoders[encoder].isCapturingTime())
+  {
+    encoders[encoder].setCaptureTime(true);
+  }
+}
+
+// Report position, velocity and time of the last count of one encoder
+void reportEncoderVelocity(byte encoder)
+{
+  if (isEncoderAttached(encoder))
+  {
+    captureEncoderTime(encoder);
+    positions[encoder] = encoders[encoder].read();
+    Firmata.write(START_SYSEX);
+    Firmata.write(ENCODER_DATA);
+    Firmata.write(ENCODER_REPORT_TIMED);
+    writeEncoderVelocity(encoder);
+    Firmata.write(END_SYSEX);
+  }
+}
 
-        prevPositions[encoderNum] = positions[encoderNum];
-        long absValue = abs(positions[encoderNum]);
-        byte direction = positions[encoderNum] >= 0 ? 0x00 : 0x01;
-        Firmata.write((direction << 6) | (encoderNum));
-        Firmata.write((byte)absValue & 0x7F);
-        Firmata.write((byte)(absValue >> 7) & 0x7F);
-        Firmata.write((byte)(absValue >> 14) & 0x7F);
-        Firmata.write((byte)(absValue >> 21) & 0x7F);
+// Report position, velocity and time of every encoder that moved or changed speed
+void reportEncoderVelocities()
+{
+  bool report = false;
+  readEncoderPositions();
+  for (ENCODER_SLOT_TYPE slots = attachedEncoders; slots; slots &= slots - 1)
+  {
+    byte encoderNum = ENCODER_FIRST_SLOT(slots);
+    captureEncoderTime(encoderNum);
+    if (positions[encoderNum] != prevPositions[encoderNum] ||
+        encoders[encoderNum].readVelocity() != prevVelocities[encoderNum])
+    {
+      if (!report)
+      {
+        Firmata.write(START_SYSEX);
+        Firmata.write(ENCODER_DATA);
+        Firmata.write(ENCODER_REPORT_TIMED);
+        report = true;
       }
+      writeEncoderVelocity(encoderNum);
     }
   }
   if (report)
@@ -1475,8 +2507,78 @@ void reportEncoderPositions()
   }
 }
 
+/*
+   Report the encoders that moved as signed deltas from the last reported
+   position. After ENCODER_REPORT_DELTAS comes a bitmask of the encoders
+   included (7 encoders per byte, encoder 0 in bit 0 of the first byte),
+   then one delta per set bit. A delta is zigzag encoded (0, -1, 1, -2...)
+   and sent 6 bits at a time, least significant first, with bit 6 set on
+   every byte but the last, so moves of -32 to 31 counts take one byte.
+   The host adds the deltas to the positions from the last absolute report,
+   which is resent for every encoder each encoderKeyframeInterval reports.
+*/
+void reportEncoderDeltas()
+{
+  ENCODER_SLOT_TYPE changed = 0;
+  ENCODER_SLOT_TYPE slots;
+  byte data[(MAX_ENCODERS + 6) / 7 > ENCODER_DELTA_BYTES ? (MAX_ENCODERS + 6) / 7 : ENCODER_DELTA_BYTES];
+
+  readEncoderPositions();
+  for (slots = attachedEncoders; slots; slots &= slots - 1)
+  {
+    byte encoderNum = ENCODER_FIRST_SLOT(slots);
+    if (positions[encoderNum] != prevPositions[encoderNum])
+    {
+      changed |= ENCODER_SLOT(encoderNum);
+    }
+  }
+  if (!changed)
+  {
+    return;
+  }
+
+  Firmata.write(START_SYSEX);
+  Firmata.write(ENCODER_DATA);
+  Firmata.write(ENCODER_REPORT_DELTAS);
+  writeEncoderBytes(data, packEncoderSlots(changed, (MAX_ENCODERS + 6) / 7, data));
+  for (slots = changed; slots; slots &= slots - 1)
+  {
+    byte encoderNum = ENCODER_FIRST_SLOT(slots);
+    int32_t delta = positions[encoderNum] - prevPositions[encoderNum];
+    prevPositions[encoderNum] = positions[encoderNum];
+    writeEncoderBytes(data, packEncoderDelta(delta, data));
+  }
+  Firmata.write(END_SYSEX);
+}
+
+// Automatic report on each sampling interval, in the mode set by ENCODER_REPORT_AUTO
+void reportEncodersAuto()
+{
+  if (reportEncoders == ENCODER_AUTO_DELTA)
+  {
+    if (encoderKeyframeCount >= encoderKeyframeInterval)
+    {
+      encoderKeyframeCount = 0;
+      reportEncoderPositions(true);
+    }
+    else
+    {
+      reportEncoderDeltas();
+    }
+    encoderKeyframeCount++;
+  }
+  else if (reportEncoders == ENCODER_AUTO_VELOCITY)
+  {
+    reportEncoderVelocities();
+  }
+  else
+  {
+    reportEncoderPositions(false);
+  }
+}
+
 boolean isEncoderAttached(byte encoderNum) {
-  return (encoderNum < MAX_ENCODERS && encoderNum < numAttachedEncoders/*&& encoders[encoderNum]*/);
+  return (encoderNum < MAX_ENCODERS && (attachedEncoders & ENCODER_SLOT(encoderNum)));
 }
 
 /*==============================================================================
@@ -1485,7 +2587,6 @@ boolean isEncoderAttached(byte encoderNum) {
 
 void systemResetCallback()
 {
-  Stream *serialPort;
   isResetting = true;
 
   // initialize a defalt state
@@ -1495,21 +2596,13 @@ void systemResetCallback()
     disableI2CPins();
   }
 
-#if defined(SoftwareSerial_h)
-  // free memory allocated for SoftwareSerial ports
-  for (byte i = SW_SERIAL0; i < SW_SERIAL3 + 1; i++) {
-    serialPort = getPortFromId(i);
-    if (serialPort != NULL) {
-      free(serialPort);
-      serialPort = NULL;
-    }
-  }
-#endif
-
   serialIndex = -1;
-  for (byte i = 0; i < SERIAL_READ_ARR_LEN; i++) {
-    serialBytesToRead[i] = 0;
+  resetSerialPorts();
+  for (byte i = 0; i < SERIAL_BATCH_PORTS; i++) {
+    serialBatch[i].portId = -1;
   }
+  resetTxStats();
+  clearSamplingStats();
 
   for (byte i = 0; i < TOTAL_PORTS; i++) {
     reportPINs[i] = false;    // by default, reporting off
@@ -1532,15 +2625,22 @@ void systemResetCallback()
   }
   // by default, do not report any analog inputs
   analogInputsToReport = 0;
+  analogBlocks = false;
+  analogBlockSeq = 0;
+  analogBlockSync = true;
+  AnalogStream.end();
 
+  stepperGroup.clear();
   for (byte i = 0; i < MAX_STEPPERS; i++)
   {
     if (stepper[i])
     {
-      free(stepper[i]);
+      delete stepper[i];
       stepper[i] = 0;
     }
+    stepperQueueDepth[i] = 0;
   }
+  Stepper::clearRampTables();
   numSteppers = 0;
   detachedServoCount = 0;
   servoCount = 0;
@@ -1554,6 +2654,7 @@ void systemResetCallback()
     detachEncoder(encoder);
   }
   reportEncoders = 0x00;
+  encoderKeyframeInterval = ENCODER_KEYFRAME_INTERVAL;
 
 
   for (int i = 0; i < TOTAL_PINS; i++) {
@@ -1592,87 +2693,288 @@ void setup()
   Firmata.attach(SYSTEM_RESET, systemResetCallback);
 
   // to use a port other than Serial, such as Serial1 on an Arduino Leonardo or Mega,
-  // Call begin(baud) on the alternate serial port and pass it to Firmata to begin like this:
+  // Call begin(baud) on the alternate serial port and buffer it instead of Serial:
   // Serial1.begin(57600);
-  // Firmata.begin(Serial1);
+  // BufferedStream firmataStream(Serial1);
+  // and change FIRMATA_TX_SPACE() to match.
   // However do not do this if you are using SERIAL_MESSAGE
 
-  Firmata.begin(57600);
+  Serial.begin(57600);
+#if defined(ARDUINO) && ARDUINO >= 10606
+  firmataStream.setStreamSpace(firmataTxSpace);
+#endif
+  Firmata.begin(firmataStream);
   while (!Serial) {
     ; // wait for serial port to connect. Only needed for ATmega32u4-based boards (Leonardo, etc).
   }
   systemResetCallback();  // reset to default config
+
+  // priority, period and budget in micros; motion and inputs always run,
+  // reports are put off a pass when the pass is already long
+  scheduler.add(inputTask, 0, 0, 200);
+  scheduler.add(stepperTask, 0, 0, 100);
+  scheduler.add(encoderPollTask, 0, 0, 50);
+  scheduler.add(i2cTask, 1, 0, 200);
+  scheduler.add(analogStreamTask, 1, 0, 300);
+  samplingTaskId = scheduler.add(samplingTask, 1, samplingInterval * 1000UL, 800);
+  scheduler.setCatchUp(samplingTaskId, SAMPLING_CATCH_UP);
+  samplingStatsStart = millis();
+  scheduler.add(checkSerial, 2, 0, 300);
 }
 
 /*==============================================================================
-   LOOP()
+   TASKS - run by the scheduler in loop(), priority 0 first
   ============================================================================*/
-void loop()
-{
-  byte pin, analogPin;
 
-  /* DIGITALREAD - as fast as possible, check for changes and output them to the
-     FTDI buffer using Serial.print()  */
+/* DIGITALREAD - as fast as possible, check for changes and output them to the
+   FTDI buffer using Serial.print()
+   STREAMREAD - processing incoming messagse as soon as possible, while still
+   checking digital inputs.  */
+void inputTask()
+{
   checkDigitalInputs();
-
-  /* STREAMREAD - processing incoming messagse as soon as possible, while still
-     checking digital inputs.  */
   while (Firmata.available())
     Firmata.processInput();
+}
 
-  // if one or more stepper motors are used, update their position
-  if (numSteppers > 0)
+// if one or more stepper motors are used, update their position
+void stepperTask()
+{
+  if (numSteppers == 0)
+  {
+    return;
+  }
+  for (int i = 0; i < MAX_STEPPERS; i++)
   {
-    for (int i = 0; i < MAX_STEPPERS; i++)
+    if (stepper[i])
     {
-      if (stepper[i])
+      bool done = stepper[i]->update();
+      // send command to client application when stepping is complete
+      if (done)
       {
-        bool done = stepper[i]->update();
-        // send command to client application when stepping is complete
-        if (done)
+        byte doneDevice = i;
+        // the followers arrive on the leader's last step
+        if (stepperGroup.isLeader(stepper[i]))
         {
-          Firmata.write(START_SYSEX);
-          Firmata.write(STEPPER_DATA);
-          Firmata.write(STEPPER_DONE);
-          Firmata.write(i & 0x7F);
-          Firmata.write(END_SYSEX);
+          doneDevice = stepperGroupDevice;
+          stepperGroup.clear();
         }
+        Firmata.write(START_SYSEX);
+        Firmata.write(STEPPER_DATA);
+        Firmata.write(STEPPER_DONE);
+        Firmata.write(doneDevice & 0x7F);
+        Firmata.write(END_SYSEX);
+      }
+      // tell the host when a queued move has started so it can send more
+      if (stepper[i]->getQueueDepth() < stepperQueueDepth[i])
+      {
+        reportStepperQueueDepth(i);
       }
     }
   }
-  //the delay in the reporting interval causes encoders to report incorrectly
-  //need to refresh them faster
-  for (byte i = 0; i < numAttachedEncoders; i++)
+}
+
+// encoders without two interrupt pins only count when read, so sample
+// them every loop; the others are read when a report is due
+void encoderPollTask()
+{
+  for (ENCODER_SLOT_TYPE slots = polledEncoders; slots; slots &= slots - 1)
+  {
+    encoders[ENCODER_FIRST_SLOT(slots)].read();
+  }
+}
+
+// reply to finished I2C reads and start the next one
+void i2cTask()
+{
+  if (isI2CEnabled)
   {
-    int32_t encPosition = encoders[i].read();
-    if (positions[i] != encPosition)
-      positions[i] = encPosition;
+    updateI2C();
   }
-  // TODO - ensure that Stream buffer doesn't go over 60 bytes
+}
+
+// runs every samplingInterval
+void samplingTask()
+{
+  byte pin, analogPin;
 
-  currentMillis = millis();
-  if (currentMillis - previousMillis > samplingInterval) {
-    previousMillis += samplingInterval;
-    /* ANALOGREAD - do all analogReads() at the configured sampling interval */
+  /* ANALOGREAD - do all analogReads() at the configured sampling interval */
+  if (AnalogStream.isRunning()) {
+    // the ADC is taken by the stream
+  } else if (analogBlocks) {
+    reportAnalogBlock();
+  } else {
     for (pin = 0; pin < TOTAL_PINS; pin++) {
       if (IS_PIN_ANALOG(pin) && pinConfig[pin] == PIN_MODE_ANALOG) {
         analogPin = PIN_TO_ANALOG(pin);
         if (analogInputsToReport & (1 << analogPin)) {
-          Firmata.sendAnalog(analogPin, analogRead(analogPin));
+          if (txRoom() >= 3) {
+            Firmata.sendAnalog(analogPin, analogRead(analogPin));
+          } else {
+            txCounters[TX_DROPPED_ANALOG]++;
+          }
         }
       }
     }
-    // report i2c data for all device with read continuous mode enabled
-    if (queryIndex > -1) {
-      for (byte i = 0; i < queryIndex + 1; i++) {
-        readAndReportData(query[i].addr, query[i].reg, query[i].bytes);
+  }
+  if (reportEncoders)
+  {
+    reportEncodersAuto();
+  }
+}
+
+/*
+   Send the reported analog inputs of one tick in a single ANALOG_BLOCK
+   message: the time since the previous block in 14 bits of
+   ANALOG_BLOCK_TICK micros, then the values, 14 bits each in pin order,
+   5 + 2 bytes a pin against 3 a pin for ANALOG_MESSAGEs.
+
+   The time is ANALOG_BLOCK_FULL instead when a full header follows: a
+   14-bit sequence number, the micros() when sampling started as 32 bits
+   and the mask of the analog pins sampled. A block without it has the
+   sequence number after the previous one and the same pins. The full
+   header goes with the first block, every ANALOG_BLOCK_SYNC blocks, when
+   the pins change, when the time since the previous block doesn't fit,
+   and after a block that found no room: such a block is dropped but still
+   takes a sequence number, so the host sees the gap.
+*/
+void reportAnalogBlock()
+{
+  unsigned int mask = 0;
+  byte count = 0;
+  byte pin, analogPin;
+
+  for (pin = 0; pin < TOTAL_PINS; pin++) {
+    if (IS_PIN_ANALOG(pin) && pinConfig[pin] == PIN_MODE_ANALOG) {
+      analogPin = PIN_TO_ANALOG(pin);
+      if (analogInputsToReport & (1 << analogPin)) {
+        mask |= 1 << analogPin;
+        count++;
       }
     }
-    if (reportEncoders)
-    {
-      reportEncoderPositions();
+  }
+  if (count == 0) {
+    return;
+  }
+
+  unsigned long time = micros();
+  unsigned int seq = analogBlockSeq;
+  unsigned long ticks = (time - analogBlockTime) / ANALOG_BLOCK_TICK;
+  boolean full = analogBlockSync || mask != analogBlockMask || ticks >= ANALOG_BLOCK_FULL ||
+                 (seq & (ANALOG_BLOCK_SYNC - 1)) == 0;
+
+  analogBlockSeq = (analogBlockSeq + 1) & 0x3FFF;
+  if (txRoom() < (full ? ANALOG_BLOCK_FULL_HEADER : ANALOG_BLOCK_HEADER) + 2 * count) {
+    txCounters[TX_DROPPED_ANALOG]++;
+    analogBlockSync = true;
+    return;
+  }
+
+  Firmata.write(START_SYSEX);
+  Firmata.write(ANALOG_BLOCK);
+  if (full) {
+    Firmata.write(ANALOG_BLOCK_FULL & 0x7F);
+    Firmata.write(ANALOG_BLOCK_FULL >> 7);
+    Firmata.write(seq & 0x7F);
+    Firmata.write((seq >> 7) & 0x7F);
+    for (byte i = 0; i < 5; i++) {
+      Firmata.write((byte)(time >> (i * 7)) & 0x7F);
+    }
+    for (byte i = 0; i < ANALOG_BLOCK_MASK_BYTES; i++) {
+      Firmata.write((byte)(mask >> (i * 7)) & 0x7F);
+    }
+    analogBlockTime = time;
+    analogBlockMask = mask;
+    analogBlockSync = false;
+  } else {
+    Firmata.write(ticks & 0x7F);
+    Firmata.write((ticks >> 7) & 0x7F);
+    // the remainder is carried into the next block
+    analogBlockTime += ticks * ANALOG_BLOCK_TICK;
+  }
+  for (analogPin = 0; analogPin < TOTAL_ANALOG_PINS; analogPin++) {
+    if (mask & (1 << analogPin)) {
+      int value = analogRead(analogPin);
+      Firmata.write(value & 0x7F);
+      Firmata.write((value >> 7) & 0x7F);
     }
   }
+  Firmata.write(END_SYSEX);
+}
+
+// mask of the analog pins set to ANALOG mode
+unsigned int analogModePins()
+{
+  unsigned int mask = 0;
+
+  for (byte pin = 0; pin < TOTAL_PINS; pin++) {
+    if (IS_PIN_ANALOG(pin) && pinConfig[pin] == PIN_MODE_ANALOG) {
+      mask |= 1 << PIN_TO_ANALOG(pin);
+    }
+  }
+  return mask;
+}
+
+/*
+   Send the samples of the analog stream in ANALOG_STREAM messages of
+   ANALOG_STREAM_BLOCK samples, as long as the host link has room; until
+   then they wait in the stream buffer. Each message holds a 14-bit
+   sequence number, the samples lost to a full buffer since the previous
+   message (14 bits, saturating), the micros() when its first sample was
+   converted as 32 bits and the samples, the analog pin in the top 4 of 14 bits and the value
+   in the low 10. A partial block is only sent when all is set.
+*/
+void reportAnalogStream(boolean all)
+{
+  while (AnalogStream.available() >= ANALOG_STREAM_BLOCK || (all && AnalogStream.available() > 0)) {
+    byte count = AnalogStream.available();
+    if (count > ANALOG_STREAM_BLOCK) {
+      count = ANALOG_STREAM_BLOCK;
+    }
+    if (!all && txRoom() < ANALOG_STREAM_HEADER + 2 * count) {
+      return;
+    }
+
+    unsigned int overruns = AnalogStream.takeOverruns();
+    unsigned long time = AnalogStream.blockTime();
+    if (overruns > 0x3FFF) {
+      overruns = 0x3FFF;
+    }
+    Firmata.write(START_SYSEX);
+    Firmata.write(ANALOG_STREAM);
+    Firmata.write(analogStreamSeq & 0x7F);
+    Firmata.write((analogStreamSeq >> 7) & 0x7F);
+    Firmata.write(overruns & 0x7F);
+    Firmata.write((overruns >> 7) & 0x7F);
+    for (byte i = 0; i < 5; i++) {
+      Firmata.write((byte)(time >> (i * 7)) & 0x7F);
+    }
+    for (byte i = 0; i < count; i++) {
+      unsigned int sample = AnalogStream.read();
+      Firmata.write(sample & 0x7F);
+      Firmata.write((sample >> 7) & 0x7F);
+    }
+    Firmata.write(END_SYSEX);
+    analogStreamSeq = (analogStreamSeq + 1) & 0x3FFF;
+  }
+}
+
+// ships the samples of the analog stream
+void analogStreamTask()
+{
+  if (AnalogStream.isRunning())
+  {
+    reportAnalogStream(false);
+  }
+}
+
+/*==============================================================================
+   LOOP()
+  ============================================================================*/
+void loop()
+{
+  scheduler.run();
 
-  checkSerial();
+  // send what the host link takes now, the rest waits for the next pass
+  firmataStream.flushAvailable(FIRMATA_TX_SPACE());
 }
@@ -0,0 +1,191 @@
+/*
+  AnalogStream.cpp - interrupt driven analog sampling, see AnalogStream.h
+  */
+
+#include "AnalogStream.h"
+
+#define BUFFER_MASK (ANALOG_STREAM_BUFFER - 1)
+
+AnalogStreamClass AnalogStream;
+
+#ifdef ANALOG_STREAM_USE_INTERRUPTS
+ISR(ADC_vect) {
+	AnalogStream.handleInterrupt();
+}
+#endif
+
+AnalogStreamClass::AnalogStreamClass()
+{
+	_head = 0;
+	_tail = 0;
+	_overruns = 0;
+	_running = false;
+}
+
+bool AnalogStreamClass::isRunning()
+{
+	return _running;
+}
+
+byte AnalogStreamClass::available()
+{
+	return (byte)(_head - _tail) & BUFFER_MASK;
+}
+
+unsigned int AnalogStreamClass::read()
+{
+	unsigned int sample = _buffer[_tail];
+	_tail = (_tail + 1) & BUFFER_MASK;
+	return sample;
+}
+
+unsigned long AnalogStreamClass::blockTime()
+{
+	return _blockTime[_tail / ANALOG_STREAM_BLOCK];
+}
+
+#ifdef ANALOG_STREAM_USE_INTERRUPTS
+
+unsigned int AnalogStreamClass::takeOverruns()
+{
+	uint8_t oldSREG = SREG;
+	cli();
+	unsigned int overruns = _overruns;
+	_overruns = 0;
+	SREG = oldSREG;
+	return overruns;
+}
+
+bool AnalogStreamClass::begin(unsigned int mask, byte prescaler, byte decimation)
+{
+	end();
+	_count = 0;
+	for (byte pin = 0; pin < ANALOG_STREAM_MAX_PINS; pin++) {
+		if (mask & (1 << pin)) {
+			byte channel = pin;
+#if defined(analogPinToChannel)
+			channel = analogPinToChannel(pin);
+#endif
+			_pins[_count] = pin;
+			_mux[_count] = channel;
+			_count++;
+		}
+	}
+	if (_count == 0) {
+		return true;
+	}
+	if (prescaler < ANALOG_STREAM_MIN_PRESCALER) {
+		prescaler = ANALOG_STREAM_MIN_PRESCALER;
+	}
+	else if (prescaler > 7) {
+		prescaler = 7;
+	}
+
+	_head = 0;
+	_tail = 0;
+	_overruns = 0;
+	_decimation = decimation > 0 ? decimation : 1;
+	_round = 0;
+	_discard = true;
+	_resultIndex = 0;
+	_muxIndex = 0;
+	_savedADCSRA = ADCSRA;
+	_savedADCSRB = ADCSRB;
+	_savedADMUX = ADMUX;
+	ADCSRB = 0;
+	selectPin(0);
+	_running = true;
+	// free running (ADTS bits of ADCSRB clear), interrupt on every conversion
+	ADCSRA = _BV(ADEN) | _BV(ADSC) | _BV(ADATE) | _BV(ADIE) | prescaler;
+	return true;
+}
+
+void AnalogStreamClass::end()
+{
+	if (_running) {
+		// stop the interrupts and free running, then let the conversion in
+		// progress finish before the channel goes back
+		ADCSRA &= ~(_BV(ADATE) | _BV(ADIE));
+		while (ADCSRA & _BV(ADSC))
+			;
+		ADMUX = _savedADMUX;
+		ADCSRB = _savedADCSRB;
+		// writing ADIF clears the flag of the last conversion
+		ADCSRA = (_savedADCSRA & ~(_BV(ADATE) | _BV(ADIE))) | _BV(ADIF);
+		_running = false;
+	}
+}
+
+/**
+ * Select the ADC channel of a pin, applied to the conversion started after
+ * the one in progress.
+ * @private
+ */
+void AnalogStreamClass::selectPin(byte index)
+{
+	byte channel = _mux[index];
+#if defined(MUX5)
+	ADCSRB = (channel & 0x08) ? _BV(MUX5) : 0;
+#endif
+	ADMUX = (DEFAULT << 6) | (channel & 0x07);
+}
+
+void AnalogStreamClass::handleInterrupt()
+{
+	unsigned int value = ADC;
+	byte index = _resultIndex;
+
+	// the next conversion has already started on the selected pin, select
+	// the one after it
+	_resultIndex = _muxIndex;
+	if (_count > 1) {
+		_muxIndex++;
+		if (_muxIndex == _count) {
+			_muxIndex = 0;
+		}
+		selectPin(_muxIndex);
+	}
+
+	if (_discard) {
+		// the first conversion takes longer and may be off
+		_discard = false;
+		return;
+	}
+	if (index == 0 && ++_round >= _decimation) {
+		_round = 0;
+	}
+	if (_round != 0) {
+		return;
+	}
+
+	byte head = (_head + 1) & BUFFER_MASK;
+	if (head == _tail) {
+		if (_overruns < 0xFFFF) {
+			_overruns++;
+		}
+		return;
+	}
+	if (_head % ANALOG_STREAM_BLOCK == 0) {
+		_blockTime[_head / ANALOG_STREAM_BLOCK] = micros();
+	}
+	_buffer[_head] = ((unsigned int)_pins[index] << ANALOG_STREAM_PIN_SHIFT) | value;
+	_head = head;
+}
+
+#else
+
+unsigned int AnalogStreamClass::takeOverruns()
+{
+	return 0;
+}
+
+bool AnalogStreamClass::begin(unsigned int, byte, byte)
+{
+	return false;
+}
+
+void AnalogStreamClass::end()
+{
+}
+
+#endif
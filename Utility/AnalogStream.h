@@ -0,0 +1,120 @@
+/*
+  AnalogStream runs the ADC free-running and takes every conversion from
+  the conversion complete interrupt, so analog inputs are sampled at
+  several kHz without blocking loop() the 110 micros analogRead() takes.
+  The selected analog pins are converted one after the other and the
+  samples collect in a ring buffer until read.
+
+  The sample rate is set by the ADC prescaler: a conversion takes 13 ADC
+  clocks, so 16 MHz / 128 / 13 = 9.6 kHz shared by all the pins, up to
+  38.5 kHz with reduced accuracy at a prescaler of 32, the fastest begin()
+  allows: below that a conversion is over before the interrupt taking it
+  is, and loop() never runs again. Only one round of
+  conversions out of every decimation rounds is kept, to match a slower
+  host link.
+
+  Each sample holds the analog pin in its top bits and the 10-bit value
+  below. The interrupt stamps the first sample of every block of
+  ANALOG_STREAM_BLOCK with micros(), so the host gets the time the
+  samples were taken rather than the time they were sent; read them a
+  whole block at a time to keep the stamps lined up. analogRead() must not be used while the stream runs. Only AVR
+  boards are supported; begin() returns false on the others.
+  */
+
+#ifndef AnalogStream_h
+#define AnalogStream_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#if defined(__AVR__) && defined(ADC_vect) && defined(ADATE) && !defined(ANALOG_STREAM_DO_NOT_USE_INTERRUPTS)
+#define ANALOG_STREAM_USE_INTERRUPTS
+#endif
+
+// samples held, a power of 2 up to 256
+#ifndef ANALOG_STREAM_BUFFER
+#if defined(RAMEND) && RAMEND < 0x1000
+#define ANALOG_STREAM_BUFFER 64
+#else
+#define ANALOG_STREAM_BUFFER 256
+#endif
+#endif
+
+// samples per time stamp, the buffer holds whole blocks
+#ifndef ANALOG_STREAM_BLOCK
+#if defined(RAMEND) && RAMEND < 0x1000
+#define ANALOG_STREAM_BLOCK 16
+#else
+#define ANALOG_STREAM_BLOCK 32
+#endif
+#endif
+
+#if ANALOG_STREAM_BUFFER % ANALOG_STREAM_BLOCK != 0
+#error "ANALOG_STREAM_BUFFER must be a multiple of ANALOG_STREAM_BLOCK"
+#endif
+
+#define ANALOG_STREAM_MIN_PRESCALER 5 // ADPS bits, F_CPU / 32
+
+#define ANALOG_STREAM_MAX_PINS   16
+#define ANALOG_STREAM_PIN_SHIFT  10   // sample = analog pin << 10 | value
+
+class AnalogStreamClass
+{
+public:
+	AnalogStreamClass();
+
+	// start converting the analog pins set in mask at F_CPU / 2^prescaler
+	// / 13 samples per second in all, keeping one round in decimation; the
+	// prescaler is held to ANALOG_STREAM_MIN_PRESCALER to 7
+	bool begin(unsigned int mask, byte prescaler, byte decimation);
+	void end();
+	bool isRunning();
+
+	// samples waiting in the buffer
+	byte available();
+
+	// take the oldest sample
+	unsigned int read();
+
+	// micros() when the oldest sample was converted, for a sample that
+	// starts a block
+	unsigned long blockTime();
+
+	// samples lost because the buffer was full, cleared when taken
+	unsigned int takeOverruns();
+
+#ifdef ANALOG_STREAM_USE_INTERRUPTS
+	void handleInterrupt();
+#endif
+
+private:
+	volatile unsigned int _buffer[ANALOG_STREAM_BUFFER];
+	volatile byte _head;          // next sample written by the interrupt
+	volatile byte _tail;          // next sample read
+	volatile unsigned long _blockTime[ANALOG_STREAM_BUFFER / ANALOG_STREAM_BLOCK];
+	volatile unsigned int _overruns;
+	bool _running;
+
+#ifdef ANALOG_STREAM_USE_INTERRUPTS
+	void selectPin(byte index);
+
+	byte _pins[ANALOG_STREAM_MAX_PINS];
+	byte _mux[ANALOG_STREAM_MAX_PINS];  // ADC channel of each pin
+	byte _count;
+	byte _resultIndex;            // pin of the conversion in progress
+	byte _muxIndex;               // pin selected for the conversion after it
+	byte _decimation;
+	byte _round;                  // rounds since the last one kept
+	bool _discard;                // the first result after starting
+	byte _savedADCSRA;
+	byte _savedADCSRB;
+	byte _savedADMUX;
+#endif
+};
+
+extern AnalogStreamClass AnalogStream;
+
+#endif
@@ -0,0 +1,123 @@
+/*
+  BufferedStream.cpp - bulk writes to a stream, see BufferedStream.h
+  */
+
+#include "BufferedStream.h"
+
+BufferedStream::BufferedStream(Stream &stream)
+{
+	_stream = &stream;
+	_streamSpace = NULL;
+	_head = 0;
+	_count = 0;
+	_stalls = 0;
+}
+
+int BufferedStream::available()
+{
+	return _stream->available();
+}
+
+int BufferedStream::read()
+{
+	return _stream->read();
+}
+
+int BufferedStream::peek()
+{
+	return _stream->peek();
+}
+
+size_t BufferedStream::write(uint8_t data)
+{
+	if (_count == BUFFERED_STREAM_SIZE) {
+		makeRoom();
+	}
+	byte tail = _head + _count;
+	if (tail >= BUFFERED_STREAM_SIZE) {
+		tail -= BUFFERED_STREAM_SIZE;
+	}
+	_data[tail] = data;
+	_count++;
+	return 1;
+}
+
+void BufferedStream::flush()
+{
+	send(_count);
+	_stream->flush();
+}
+
+void BufferedStream::flushAvailable(int space)
+{
+	if (space > _count) {
+		space = _count;
+	}
+	if (space > 0) {
+		send(space);
+	}
+}
+
+void BufferedStream::setStreamSpace(int (*streamSpace)(void))
+{
+	_streamSpace = streamSpace;
+}
+
+int BufferedStream::pending()
+{
+	return _count;
+}
+
+int BufferedStream::space()
+{
+	return BUFFERED_STREAM_SIZE - _count;
+}
+
+unsigned long BufferedStream::stalls()
+{
+	return _stalls;
+}
+
+void BufferedStream::resetStalls()
+{
+	_stalls = 0;
+}
+
+/**
+ * Hand on what the stream takes without blocking to make room for one more
+ * byte. When it takes nothing, or can't tell, wait for it and count a stall.
+ * @private
+ */
+void BufferedStream::makeRoom()
+{
+	int space = _streamSpace != NULL ? _streamSpace() : 0;
+	if (space > 0) {
+		send(space < _count ? space : _count);
+	}
+	else {
+		_stalls++;
+		send(_streamSpace != NULL ? 1 : _count);
+	}
+}
+
+/**
+ * Write the oldest length bytes, in two writes when they wrap around the
+ * end of the buffer.
+ * @private
+ */
+void BufferedStream::send(int length)
+{
+	while (length > 0) {
+		int chunk = BUFFERED_STREAM_SIZE - _head;
+		if (chunk > length) {
+			chunk = length;
+		}
+		_stream->write(&_data[_head], chunk);
+		_head += chunk;
+		if (_head == BUFFERED_STREAM_SIZE) {
+			_head = 0;
+		}
+		_count -= chunk;
+		length -= chunk;
+	}
+}
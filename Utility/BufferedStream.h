@@ -0,0 +1,77 @@
+/*
+  BufferedStream collects the bytes written to a stream and hands them on
+  in bulk, so the reports of one pass of loop() leave in a few writes
+  instead of one virtual call and one TX buffer access per byte. Reads
+  pass straight through.
+
+  flushAvailable() only writes what the stream can take without blocking
+  and keeps the rest for later, so a slow host link no longer stalls the
+  caller. Writing to a full buffer hands on what the stream takes without
+  blocking, when setStreamSpace() says how much that is, and only waits
+  for the stream once it takes nothing, as writing to it directly would.
+  So space() plus the stream space can be written without waiting; the
+  caller can leave out what can wait before it comes to that, and
+  stalls() counts the times it did.
+  */
+
+#ifndef BufferedStream_h
+#define BufferedStream_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#ifndef BUFFERED_STREAM_SIZE
+#if defined(RAMEND) && RAMEND < 0x1000
+#define BUFFERED_STREAM_SIZE 64
+#else
+#define BUFFERED_STREAM_SIZE 128
+#endif
+#endif
+
+class BufferedStream : public Stream
+{
+public:
+	BufferedStream(Stream &stream);
+
+	virtual int available();
+	virtual int read();
+	virtual int peek();
+	virtual size_t write(uint8_t data);
+	using Print::write;
+
+	// write all the buffered bytes, waiting for the stream if needed
+	virtual void flush();
+
+	// write at most space buffered bytes and keep the rest
+	void flushAvailable(int space);
+
+	// bytes the stream takes without blocking, such as availableForWrite()
+	// of a serial port; without it a full buffer is written all at once
+	void setStreamSpace(int (*streamSpace)(void));
+
+	// bytes waiting in the buffer
+	int pending();
+
+	// bytes that can be written before the buffer is full
+	int space();
+
+	// writes that had to wait for the stream
+	unsigned long stalls();
+	void resetStalls();
+
+private:
+	void makeRoom();
+	void send(int length);
+
+	Stream *_stream;
+	int (*_streamSpace)(void);
+	byte _data[BUFFERED_STREAM_SIZE];
+	byte _head;               // oldest byte
+	byte _count;
+	unsigned long _stalls;
+};
+
+#endif
@@ -51,6 +51,24 @@
 #define ENCODER_ARGLIST_SIZE 0
 #endif
 
+// Record the time of each count, so the speed can be taken from the period
+// between counts instead of from positions sampled at a jittery interval.
+// Each encoder opts in with setCaptureTime(); the others only pay a test
+// of the flag per edge. The time is taken only when the position changed,
+// and on AVR from Timer0 inline rather than by calling micros(), so the
+// interrupt handler calls nothing and saves only the registers it uses.
+// Define ENCODER_DO_NOT_CAPTURE_TIME to leave it all out.
+#if defined(ENCODER_CAPTURE_TIME) || !defined(ENCODER_DO_NOT_CAPTURE_TIME)
+#define ENCODER_CAPTURE_TIME
+#if defined(__AVR__) && defined(TIFR0)
+extern "C" volatile unsigned long timer0_overflow_count;	// wiring.c
+#endif
+#endif
+
+// readVelocity() reports 0 when no count was seen for this many micros
+#ifndef ENCODER_VELOCITY_TIMEOUT
+#define ENCODER_VELOCITY_TIMEOUT 500000UL
+#endif
 
 
 // All the data needed by interrupts is consolidated into this ugly struct
@@ -64,13 +82,30 @@ typedef struct {
 	IO_REG_TYPE            pin2_bitmask;
 	uint8_t                state;
 	int32_t                position;
+	// fields below are not touched by the assembly code
+#ifdef ENCODER_CAPTURE_TIME
+	uint32_t               edge_time;	// micros() of the last count
+	uint32_t               edge_period;	// micros between the last two counts
+	int8_t                 edge_step;	// counts added by the last edge
+	uint8_t                capture_time;	// set by setCaptureTime()
+#endif
 } Encoder_internal_state_t;
 
 class Encoder
 {
 public:
-	Encoder(){} 
+	Encoder() {
+#ifdef ENCODER_USE_INTERRUPTS
+		interrupts_in_use = 0;
+#endif
+	}
 	Encoder(uint8_t pin1, uint8_t pin2) {
+		begin(pin1, pin2);
+	}
+	// Start counting the pins. The interrupts keep a pointer to this
+	// object, so begin() it where it is going to stay: an Encoder must not
+	// be copied or assigned while it counts.
+	void begin(uint8_t pin1, uint8_t pin2) {
 		#ifdef INPUT_PULLUP
 		pinMode(pin1, INPUT_PULLUP);
 		pinMode(pin2, INPUT_PULLUP);
@@ -85,6 +120,12 @@ public:
 		encoder.pin2_register = PIN_TO_BASEREG(pin2);
 		encoder.pin2_bitmask = PIN_TO_BITMASK(pin2);
 		encoder.position = 0;
+#ifdef ENCODER_CAPTURE_TIME
+		encoder.edge_time = 0;
+		encoder.edge_period = 0;
+		encoder.edge_step = 0;
+		encoder.capture_time = 0;
+#endif
 		// allow time for a passive R-C filter to charge
 		// through the pullup resistors, before reading
 		// the initial state
@@ -99,6 +140,18 @@ public:
 #endif
 		//update_finishup();  // to force linker to include the code (does not work)
 	}
+	// Stop counting and release the interrupts taken by begin()
+	void end() {
+#ifdef ENCODER_USE_INTERRUPTS
+		for (uint8_t i = 0; i < ENCODER_ARGLIST_SIZE; i++) {
+			if (interruptArgs[i] == &encoder) {
+				detachInterrupt(i);
+				interruptArgs[i] = NULL;
+			}
+		}
+		interrupts_in_use = 0;
+#endif
+	}
 
 
 #ifdef ENCODER_USE_INTERRUPTS
@@ -127,6 +180,70 @@ public:
 		encoder.position = p;
 	}
 #endif
+	// true when the pins are only sampled by read(), which must then be
+	// called often enough to see every edge
+#ifdef ENCODER_USE_INTERRUPTS
+	inline bool isPolled() {
+		return interrupts_in_use < 2;
+	}
+#else
+	inline bool isPolled() {
+		return true;
+	}
+#endif
+	// Start or stop recording the time of each count, which readVelocity()
+	// and readEdgeTime() need. The first count after turning it on is
+	// timed from the call.
+	void setCaptureTime(bool on) {
+#ifdef ENCODER_CAPTURE_TIME
+		noInterrupts();
+		encoder.edge_time = micros();
+		encoder.edge_period = 0;
+		encoder.edge_step = 0;
+		encoder.capture_time = on;
+		interrupts();
+#endif
+	}
+	bool isCapturingTime() {
+#ifdef ENCODER_CAPTURE_TIME
+		return encoder.capture_time;
+#else
+		return false;
+#endif
+	}
+	// Speed in counts per second, from the period between the last two
+	// counts. Once the encoder has been still for longer than that period,
+	// the time since the last count is used instead so the speed decays.
+	int32_t readVelocity() {
+#ifdef ENCODER_CAPTURE_TIME
+		uint32_t time, period;
+		int8_t step;
+		if (!encoder.capture_time) return 0;
+		read();
+		noInterrupts();
+		time = encoder.edge_time;
+		period = encoder.edge_period;
+		step = encoder.edge_step;
+		interrupts();
+		uint32_t since = micros() - time;
+		if (period == 0 || since > ENCODER_VELOCITY_TIMEOUT) return 0;
+		if (since > period) period = since;
+		return (int32_t)step * 1000000L / (int32_t)period;
+#else
+		return 0;
+#endif
+	}
+	// micros() at the last count, 0 until setCaptureTime() turned it on
+	uint32_t readEdgeTime() {
+#ifdef ENCODER_CAPTURE_TIME
+		noInterrupts();
+		uint32_t ret = encoder.edge_time;
+		interrupts();
+		return ret;
+#else
+		return 0;
+#endif
+	}
 private:
 	Encoder_internal_state_t encoder;
 #ifdef ENCODER_USE_INTERRUPTS
@@ -184,6 +301,36 @@ public:
 
 private:
 	static void update(Encoder_internal_state_t *arg) {
+#ifdef ENCODER_CAPTURE_TIME
+		// the low byte changes on every count
+		uint8_t before = arg->position;
+		update_position(arg);
+		int8_t step = (uint8_t)arg->position - before;
+		if (step && arg->capture_time) {
+			uint32_t now = edge_micros();
+			arg->edge_period = now - arg->edge_time;
+			arg->edge_time = now;
+			arg->edge_step = step;
+		}
+#else
+		update_position(arg);
+#endif
+	}
+#ifdef ENCODER_CAPTURE_TIME
+	// micros() for the interrupt handlers, with interrupts off
+	static inline uint32_t edge_micros() {
+#if defined(__AVR__) && defined(TIFR0)
+		// the same count micros() takes, inline so update() stays a leaf
+		uint32_t m = timer0_overflow_count;
+		uint8_t t = TCNT0;
+		if ((TIFR0 & _BV(TOV0)) && (t < 255)) m++;
+		return ((m << 8) + t) * (64 / clockCyclesPerMicrosecond());
+#else
+		return micros();
+#endif
+	}
+#endif
+	static void update_position(Encoder_internal_state_t *arg) {
 #if defined(__AVR__)
 		// The compiler believes this is just 1 line of code, so
 		// it will inline this function into each interrupt
@@ -267,7 +414,9 @@ private:
 			"st	-X, r23"		"\n\t"
 			"st	-X, r22"		"\n\t"
 		"L%=end:"				"\n"
-		: : "x" (arg) : "r22", "r23", "r24", "r25", "r30", "r31");
+		// memory: the state and position are written through X, and
+		// update() reads the position back
+		: "+x" (arg) : : "r22", "r23", "r24", "r25", "r30", "r31", "memory");
 #else
 		uint8_t p1val = DIRECT_PIN_READ(arg->pin1_register, arg->pin1_bitmask);
 		uint8_t p2val = DIRECT_PIN_READ(arg->pin2_register, arg->pin2_bitmask);
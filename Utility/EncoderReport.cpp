@@ -0,0 +1,48 @@
+/*
+  EncoderReport.cpp - packing of encoder reports, see EncoderReport.h
+  */
+
+#include "EncoderReport.h"
+
+byte packEncoderPosition(byte encoder, int32_t position, byte *out)
+{
+	uint32_t absValue = position >= 0 ? (uint32_t)position : -(uint32_t)position;
+
+	out[0] = (position >= 0 ? 0x00 : 0x40) | encoder;
+	for (byte i = 0; i < 4; i++) {
+		out[i + 1] = (byte)(absValue >> (i * 7)) & 0x7F;
+	}
+	return ENCODER_POSITION_BYTES;
+}
+
+byte packEncoderLong(int32_t value, byte *out)
+{
+	for (byte i = 0; i < 4; i++) {
+		out[i] = (byte)(value >> (i * 7)) & 0x7F;
+	}
+	return ENCODER_LONG_BYTES;
+}
+
+byte packEncoderDelta(int32_t delta, byte *out)
+{
+	uint32_t value = ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31);
+	byte count = 0;
+
+	do {
+		byte data = value & 0x3F;
+		value >>= 6;
+		if (value) {
+			data |= 0x40;
+		}
+		out[count++] = data;
+	} while (value);
+	return count;
+}
+
+byte packEncoderSlots(uint32_t slots, byte numBytes, byte *out)
+{
+	for (byte i = 0; i < numBytes; i++) {
+		out[i] = (byte)(slots >> (i * 7)) & 0x7F;
+	}
+	return numBytes;
+}
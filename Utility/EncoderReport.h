@@ -0,0 +1,38 @@
+/*
+  EncoderReport packs encoder positions, deltas and velocities into the
+  7-bit bytes of the ENCODER_DATA reports. Each function fills out and
+  returns the number of bytes written, so the sketch only has to send
+  them.
+
+  - Position: one byte with the sign in bit 6 and the encoder number
+    below, then the absolute value in four 7-bit groups, least
+    significant first (28 bits).
+  - Long: a signed value as 28-bit two's complement in four 7-bit
+    groups, least significant first.
+  - Delta: zigzag encoded (0, -1, 1, -2...) and sent 6 bits a byte,
+    least significant first, with bit 6 set on every byte but the last,
+    so moves of -32 to 31 counts take one byte and any 32-bit delta at
+    most six.
+  - Slots: a bitmask of encoders, 7 encoders per byte, encoder 0 in bit 0
+    of the first byte.
+  */
+
+#ifndef EncoderReport_h
+#define EncoderReport_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#define ENCODER_POSITION_BYTES 5
+#define ENCODER_LONG_BYTES     4
+#define ENCODER_DELTA_BYTES    6   // most a delta takes
+
+byte packEncoderPosition(byte encoder, int32_t position, byte *out);
+byte packEncoderLong(int32_t value, byte *out);
+byte packEncoderDelta(int32_t delta, byte *out);
+byte packEncoderSlots(uint32_t slots, byte numBytes, byte *out);
+
+#endif
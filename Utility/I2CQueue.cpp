@@ -0,0 +1,364 @@
+/*
+  I2CQueue.cpp - background I2C transfers, see I2CQueue.h
+  */
+
+#include "I2CQueue.h"
+
+#define PHASE_WRITE 0 // sending the register number or the data to write
+#define PHASE_DELAY 1 // waiting between the register number and the read
+#define PHASE_READ  2
+
+I2CQueueClass I2CQueue;
+
+#ifdef I2C_USE_INTERRUPTS
+#include <util/twi.h>
+
+#define TWCR_NEXT  (_BV(TWEN) | _BV(TWIE) | _BV(TWINT))
+#define TWCR_START (TWCR_NEXT | _BV(TWSTA))
+
+ISR(TWI_vect) {
+	I2CQueue.handleInterrupt();
+}
+#else
+// Wire can only read this many bytes per requestFrom()
+#ifdef BUFFER_LENGTH
+#define WIRE_CHUNK BUFFER_LENGTH
+#else
+#define WIRE_CHUNK 32
+#endif
+
+static void wireWrite(byte data)
+{
+#if ARDUINO >= 100
+	Wire.write((byte)data);
+#else
+	Wire.send(data);
+#endif
+}
+
+static byte wireRead(void)
+{
+#if ARDUINO >= 100
+	return Wire.read();
+#else
+	return Wire.receive();
+#endif
+}
+#endif
+
+I2CQueueClass::I2CQueueClass()
+{
+	_head = NULL;
+	_tail = NULL;
+#ifdef I2C_USE_INTERRUPTS
+	_startPending = false;
+#endif
+}
+
+void I2CQueueClass::begin()
+{
+#ifdef I2C_USE_INTERRUPTS
+	// activate the internal pullups, as Wire.begin() does
+	digitalWrite(SDA, HIGH);
+	digitalWrite(SCL, HIGH);
+	setClock(I2C_DEFAULT_CLOCK);
+	TWCR = _BV(TWEN) | _BV(TWIE);
+#else
+	Wire.begin();
+#endif
+}
+
+bool I2CQueueClass::setClock(long frequency)
+{
+#ifdef I2C_USE_INTERRUPTS
+	// SCL = F_CPU / (16 + 2 * TWBR * 4^TWPS): take the smallest prescaler
+	// that keeps TWBR within a byte, as it gives the finest steps
+	bool inRange = frequency <= F_CPU / 16;
+	unsigned long divider;
+	byte prescaler;
+
+	if (frequency <= 0) {
+		return false;
+	}
+	if (!inRange) {
+		frequency = F_CPU / 16;
+	}
+	divider = (F_CPU / frequency - 16) / 2;
+	for (prescaler = 0; prescaler < 3 && divider > 255; prescaler++) {
+		divider /= 4;
+	}
+	if (divider > 255) {
+		// the slowest clock it can make
+		divider = 255;
+		inRange = false;
+	}
+	TWSR = (TWSR & ~(_BV(TWPS0) | _BV(TWPS1))) | prescaler;
+	TWBR = divider;
+	return inRange;
+#else
+#if defined(ARDUINO) && ARDUINO >= 10600
+	Wire.setClock(frequency);
+#endif
+	return frequency > 0;
+#endif
+}
+
+void I2CQueueClass::submit(I2CTransfer *transfer)
+{
+	transfer->next = NULL;
+	transfer->count = 0;
+	if (!(transfer->flags & I2C_TRANSFER_WRITE) && transfer->length == 0) {
+		transfer->state = I2C_TRANSFER_DONE;
+		return;
+	}
+	transfer->state = I2C_TRANSFER_QUEUED;
+#ifdef I2C_USE_INTERRUPTS
+	uint8_t oldSREG = SREG;
+	cli();
+	if (_tail) {
+		_tail->next = transfer;
+		_tail = transfer;
+	}
+	else {
+		_head = _tail = transfer;
+		load();
+		start();
+	}
+	SREG = oldSREG;
+#else
+	run(transfer);
+#endif
+}
+
+bool I2CQueueClass::isIdle()
+{
+	return _head == NULL;
+}
+
+#ifdef I2C_USE_INTERRUPTS
+
+void I2CQueueClass::update()
+{
+	uint8_t oldSREG = SREG;
+	cli();
+	I2CTransfer *transfer = _head;
+	if (transfer) {
+		if (_startPending && !(TWCR & _BV(TWSTO))) {
+			// the STOP before it has gone out
+			_startPending = false;
+			TWCR = TWCR_START;
+		}
+		else if (_phase == PHASE_DELAY) {
+			if (micros() - _time >= transfer->delay) {
+				_phase = PHASE_READ;
+				start();
+			}
+		}
+		else if (micros() - _time > I2C_TIMEOUT) {
+			// no START or byte completed for too long, the bus is stuck:
+			// reset the TWI and drop the transfer
+			TWCR = 0;
+			TWCR = _BV(TWEN) | _BV(TWIE);
+			_startPending = false;
+			if (finish(I2C_TRANSFER_ERROR)) {
+				start();
+			}
+		}
+	}
+	SREG = oldSREG;
+}
+
+/**
+ * Make the transfer at the head of the queue the one on the bus, without
+ * touching the bus. Interrupts must be disabled.
+ * @private
+ */
+void I2CQueueClass::load()
+{
+	I2CTransfer *transfer = _head;
+	transfer->state = I2C_TRANSFER_BUSY;
+	_index = 0;
+	if ((transfer->flags & I2C_TRANSFER_WRITE) || transfer->reg != I2C_NO_REGISTER) {
+		_phase = PHASE_WRITE;
+	}
+	else {
+		_phase = PHASE_READ;
+	}
+}
+
+/**
+ * Request a START. A STOP still going out (it completes without an
+ * interrupt) would be cut short by it, so the START is then left to
+ * update(). Interrupts must be disabled.
+ * @private
+ */
+void I2CQueueClass::start()
+{
+	_time = micros();
+	if (TWCR & _BV(TWSTO)) {
+		_startPending = true;
+	}
+	else {
+		TWCR = TWCR_START;
+	}
+}
+
+/**
+ * Send a STOP, and when restart is set a START right after it: the TWI
+ * does both from a single write, so nothing waits for the STOP here.
+ * @private
+ */
+void I2CQueueClass::stop(bool restart)
+{
+	TWCR = TWCR_NEXT | _BV(TWSTO) | (restart ? _BV(TWSTA) : 0);
+}
+
+/**
+ * Complete the transfer at the head of the queue and load the next one.
+ * Returns true when there is one, which then needs a START.
+ * @private
+ */
+bool I2CQueueClass::finish(byte state)
+{
+	_head->state = state;
+	_head = _head->next;
+	if (_head) {
+		load();
+		return true;
+	}
+	_tail = NULL;
+	return false;
+}
+
+void I2CQueueClass::handleInterrupt()
+{
+	I2CTransfer *transfer = _head;
+	if (!transfer) {
+		TWCR = TWCR_NEXT;
+		return;
+	}
+	_time = micros();
+
+	switch (TW_STATUS) {
+	case TW_START:
+	case TW_REP_START:
+		TWDR = (transfer->address << 1) | (_phase == PHASE_READ ? TW_READ : TW_WRITE);
+		TWCR = TWCR_NEXT;
+		break;
+
+	case TW_MT_SLA_ACK:
+	case TW_MT_DATA_ACK:
+		if (transfer->flags & I2C_TRANSFER_WRITE) {
+			if (_index < transfer->length) {
+				TWDR = transfer->data[_index++];
+				transfer->count = _index;
+				TWCR = TWCR_NEXT;
+			}
+			else {
+				stop(finish(I2C_TRANSFER_DONE));
+			}
+		}
+		else if (_index == 0) {
+			TWDR = (byte)transfer->reg;
+			_index = 1;
+			TWCR = TWCR_NEXT;
+		}
+		else if (transfer->delay > 0) {
+			// update() sends the START once the delay is over
+			stop(false);
+			_phase = PHASE_DELAY;
+		}
+		else {
+			stop(true);
+			_phase = PHASE_READ;
+		}
+		break;
+
+	case TW_MR_SLA_ACK:
+		// acknowledge every byte but the last
+		TWCR = TWCR_NEXT | (transfer->length > 1 ? _BV(TWEA) : 0);
+		break;
+
+	case TW_MR_DATA_ACK:
+		transfer->data[transfer->count++] = TWDR;
+		TWCR = TWCR_NEXT | (transfer->count + 1 < transfer->length ? _BV(TWEA) : 0);
+		break;
+
+	case TW_MR_DATA_NACK:
+		transfer->data[transfer->count++] = TWDR;
+		stop(finish(I2C_TRANSFER_DONE));
+		break;
+
+	case TW_MT_ARB_LOST:
+		// another master took the bus, start the phase again once it is free
+		_index = 0;
+		transfer->count = 0;
+		TWCR = TWCR_START;
+		break;
+
+	default:
+		// address or data not acknowledged, or bus error
+		stop(finish(I2C_TRANSFER_ERROR));
+		break;
+	}
+}
+
+#else
+
+void I2CQueueClass::update()
+{
+}
+
+/**
+ * Run a transfer with the Wire library, used when the TWI interrupt is not
+ * available.
+ * @private
+ */
+void I2CQueueClass::run(I2CTransfer *transfer)
+{
+	byte count = 0;
+
+	transfer->state = I2C_TRANSFER_BUSY;
+	if (transfer->flags & I2C_TRANSFER_WRITE) {
+		Wire.beginTransmission(transfer->address);
+		for (byte i = 0; i < transfer->length; i++) {
+			wireWrite(transfer->data[i]);
+		}
+		transfer->count = transfer->length;
+		transfer->state = Wire.endTransmission() == 0 ? I2C_TRANSFER_DONE : I2C_TRANSFER_ERROR;
+		return;
+	}
+
+	if (transfer->reg != I2C_NO_REGISTER) {
+		Wire.beginTransmission(transfer->address);
+		wireWrite((byte)transfer->reg);
+		Wire.endTransmission();
+		if (transfer->delay > 0) {
+			delayMicroseconds(transfer->delay);
+		}
+	}
+	// longer reads are split, the device is expected to move on to the
+	// following register by itself as it does within a single read
+	while (count < transfer->length) {
+		byte chunk = transfer->length - count;
+		byte end;
+		if (chunk > WIRE_CHUNK) {
+			chunk = WIRE_CHUNK;
+		}
+		end = count + chunk;
+		Wire.requestFrom(transfer->address, chunk);
+		while (Wire.available()) {
+			byte data = wireRead();
+			if (count < end) {
+				transfer->data[count++] = data;
+			}
+		}
+		if (count < end) {
+			break;
+		}
+	}
+	transfer->count = count;
+	transfer->state = count == transfer->length ? I2C_TRANSFER_DONE : I2C_TRANSFER_ERROR;
+}
+
+#endif
@@ -0,0 +1,106 @@
+/*
+  I2CQueue runs I2C transfers in the background so loop() never waits on
+  the bus. Transfers are queued in order and, on AVR boards, driven one
+  after the other from the TWI interrupt. A read can first write a
+  register number and wait a delay before reading, as some devices
+  (such as the Wii Nunchuck) need time to prepare the data. The delay is
+  timed from update() instead of being busy-waited, and nothing waits
+  for a STOP to go out either: a transfer that follows another one is
+  started together with its STOP, and a START that finds a STOP still
+  going out is sent from update().
+
+  On other boards, or when I2C_DO_NOT_USE_INTERRUPTS is defined, the same
+  interface is implemented on top of the Wire library and each transfer
+  completes inside submit(). Reads longer than the Wire buffer are then
+  split into several requests.
+  */
+
+#ifndef I2CQueue_h
+#define I2CQueue_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+// The TWI interrupt is also used by the Wire library, so Wire must not be
+// included in a sketch that uses I2CQueue on AVR.
+#if defined(__AVR__) && defined(TWI_vect) && !defined(I2C_DO_NOT_USE_INTERRUPTS)
+#define I2C_USE_INTERRUPTS
+#else
+#include <Wire.h>
+#endif
+
+#define I2C_NO_REGISTER -1        // read without writing a register number first
+#define I2C_TIMEOUT 25000UL       // micros before a stuck transfer is abandoned
+#define I2C_DEFAULT_CLOCK 100000L
+
+// I2CTransfer.state
+#define I2C_TRANSFER_IDLE   0
+#define I2C_TRANSFER_QUEUED 1
+#define I2C_TRANSFER_BUSY   2
+#define I2C_TRANSFER_DONE   3
+#define I2C_TRANSFER_ERROR  4
+
+// I2CTransfer.flags
+#define I2C_TRANSFER_WRITE  0x01  // send data instead of reading into it
+
+struct I2CTransfer {
+	byte address;
+	int reg;                  // register written before reading, or I2C_NO_REGISTER
+	unsigned int delay;       // micros between writing the register and reading
+	byte *data;               // bytes read, or bytes to write
+	byte length;              // bytes to read or write
+	byte flags;
+	volatile byte count;      // bytes transferred so far
+	volatile byte state;
+	I2CTransfer *next;        // next transfer in the queue
+};
+
+class I2CQueueClass
+{
+public:
+	I2CQueueClass();
+
+	void begin();
+	// set the bus clock in Hz, returns false when it is out of the range
+	// the TWI can make and the nearest clock was set instead
+	bool setClock(long frequency);
+
+	// add a transfer to the end of the queue, the transfer must stay valid
+	// until its state is I2C_TRANSFER_DONE or I2C_TRANSFER_ERROR
+	void submit(I2CTransfer *transfer);
+
+	// start the read after the register delay and recover from a stuck bus,
+	// call from loop()
+	void update();
+
+	bool isIdle();
+
+#ifdef I2C_USE_INTERRUPTS
+	void handleInterrupt();
+#endif
+
+private:
+	I2CTransfer *_head;       // transfer on the bus
+	I2CTransfer *_tail;
+
+#ifdef I2C_USE_INTERRUPTS
+	void load();
+	void start();
+	void stop(bool restart);
+	bool finish(byte state);
+
+	volatile bool _startPending; // START waiting for a STOP to go out
+	volatile byte _phase;
+	volatile byte _index;     // bytes of the write phase sent
+	volatile unsigned long _time; // micros() at the start of the current phase
+#else
+	void run(I2CTransfer *transfer);
+#endif
+};
+
+extern I2CQueueClass I2CQueue;
+
+#endif
@@ -57,6 +57,13 @@
  * @param motor_pin_4 The pin attached to the 4th motor coil
  */
 #include "Stepper.h"
+#include "StepperGroup.h"
+
+#ifdef DIRECT_PIN_WRITE
+// coil levels for each step, bit 0 is motor pin 1 (see the tables above)
+static const byte twoWireSteps[4] = { 0x02, 0x03, 0x01, 0x00 };
+static const byte fourWireSteps[4] = { 0x05, 0x06, 0x0A, 0x09 };
+#endif
 
 Stepper::Stepper(byte interface,
 	int step_per_rev,
@@ -85,6 +92,15 @@ Stepper::Stepper(byte interface,
 	_decel = 0;
 	_speed = 100;
 	_position = 0;
+	_group = NULL;
+	_run_state = Stepper::STOP;
+	_stepCount = 0;
+	_steps_to_move = 0;
+	_move_seq = 0;
+	_queue_head = 0;
+	_queue_count = 0;
+	_ramp = NULL;
+	_ramp_record = 0;
 
 	_areLimitSwitches = false;
 	_limit_switch_a = lSwitchA;
@@ -122,22 +138,97 @@ Stepper::Stepper(byte interface,
 		pinMode(_motor_pin_4, OUTPUT);
 	}
 
+#ifdef DIRECT_PIN_WRITE
+	byte pins[4] = { _motor_pin_1, _motor_pin_2, _motor_pin_3, _motor_pin_4 };
+	byte numPins = _interface == Stepper::FOUR_WIRE ? 4 : 2;
+	const byte *steps = _interface == Stepper::FOUR_WIRE ? fourWireSteps : twoWireSteps;
+
+	_one_port = true;
+	_coil_mask = 0;
+	for (byte i = 0; i < numPins; i++) {
+		_pin_reg[i] = PIN_TO_OUTREG(pins[i]);
+		_pin_mask[i] = PIN_TO_OUTMASK(pins[i]);
+		_coil_mask |= _pin_mask[i];
+		if (_pin_reg[i] != _pin_reg[0]) {
+			_one_port = false;
+		}
+	}
+	for (byte step = 0; step < 4; step++) {
+		_coil_set[step] = 0;
+		for (byte i = 0; i < numPins; i++) {
+			if (steps[step] & (1 << i)) {
+				_coil_set[step] |= _pin_mask[i];
+			}
+		}
+	}
+	_last_direction = 0xFF;
+#endif
+
+	_at_x100 = (ALPHA_T1_FREQ_X100 + _steps_per_rev / 2) / _steps_per_rev;
+	_ax20000 = (ALPHA_X20000 + _steps_per_rev / 2) / _steps_per_rev;
+
+	_done = false;
+	_timer_count = 0;
+	_ahead_head = 0;
+	_ahead_count = 0;
+	_ahead_seq = 0;
+#ifdef STEPPER_USE_TIMER
+	// the timer itself is started by the first move
+	noInterrupts();
+	if (_timed_count < STEPPER_MAX_TIMED) {
+		_timed[_timed_count++] = this;
+	}
+	interrupts();
+#endif
+}
 
-	_alpha = TWO_PI / _steps_per_rev;
-	_at_x100 = (long)(_alpha * T1_FREQ * 100);
-	_ax20000 = (long)(_alpha * 20000);
-	_alpha_x2 = _alpha * 2;
-
+Stepper::~Stepper() {
+#ifdef STEPPER_USE_TIMER
+	bool running = false;
+	noInterrupts();
+	for (byte i = 0; i < _timed_count; i++) {
+		if (_timed[i] == this) {
+			// the timer only goes through the first _timed_count
+			_timed[i] = _timed[--_timed_count];
+			_timed[_timed_count] = NULL;
+			break;
+		}
+	}
+	for (byte i = 0; i < _timed_count; i++) {
+		if (_timed[i]->_running) {
+			running = true;
+		}
+	}
+	interrupts();
+	if (!running) {
+		stopTimer();
+	}
+#endif
 }
 
 //position of the stepper since init or distance since homing
 long Stepper::getPosition(){
+#ifdef STEPPER_USE_TIMER
+	// queued moves are added to the position from the timer interrupt
+	noInterrupts();
+	long position = _position;
+	interrupts();
+	return position;
+#else
 	return _position;
+#endif
 }
 
 //distance from current target
 long Stepper::getDistanceTo(){
+#ifdef STEPPER_USE_TIMER
+	noInterrupts();
+	unsigned long stepCount = _stepCount;
+	interrupts();
+	return (_steps_to_move - stepCount) * (_direction ? 1 : -1);
+#else
 	return (_steps_to_move - _stepCount) * (_direction ? 1 : -1);
+#endif
 }
 
 bool Stepper::getLimitSwitchState(bool side){
@@ -168,6 +259,7 @@ void Stepper::setHome(){
 /**
  * Move the stepper a given number of steps at the specified
  * speed (rad/sec), acceleration (rad/sec^2) and deceleration (rad/sec^2).
+ * This replaces the current move and discards any queued moves.
  *
  * @param steps_to_move The number ofsteps to move the motor
  * @param speed [optional] Max speed in 0.01*rad/sec
@@ -177,14 +269,20 @@ void Stepper::setHome(){
  * as a flag is safe
  */
 void Stepper::setStepsToMove(long steps_to_move, int speed, int accel, int decel) {
-	unsigned long maxStepLimit;
-	unsigned long accelerationLimit;
+	StepperMove move;
+
+	// stop the timer from stepping while the new profile is set up
+	_running = false;
+	_queue_head = 0;
+	_queue_count = 0;
+	_ahead_count = 0;
+	_ahead_seq++;
 
 	_step_number = 0;
-	_lastAccelDelay = 0;
-	_stepCount = 0;
-	_rest = 0;
-	_position += steps_to_move;
+#ifdef STEPPER_USE_TIMER
+	_done = false;
+	_timer_count = 0;
+#endif
 
 	if (speed != -1)
 		_speed = speed;
@@ -193,104 +291,469 @@ void Stepper::setStepsToMove(long steps_to_move, int speed, int accel, int decel
 	if (decel != -1)
 		_decel = decel;
 
+	planMove(&move, steps_to_move, _speed, _accel, _decel, 0, 0);
+	loadMove(&move);
+#ifdef STEPPER_USE_TIMER
+	planAhead();
+#endif
+}
+
+/**
+ * Queue a move to start when the current one (and any moves queued before
+ * it) completes. When consecutive moves go the same way and both ramp, the
+ * earlier move only slows down to the speed both can share at the junction
+ * instead of stopping. Parameters are the same as setStepsToMove().
+ * @return false if the queue is full
+ */
+bool Stepper::queueMove(long steps_to_move, int speed, int accel, int decel) {
+	StepperMove move;
+	StepperMove prev;
+	bool prevRunning;
+	unsigned long junction_sq = 0;
+
+	if (_queue_count >= STEPPER_QUEUE_SIZE) {
+		return false;
+	}
+
+	if (speed != -1)
+		_speed = speed;
+	if (accel != -1)
+		_accel = accel;
+	if (decel != -1)
+		_decel = decel;
+
+	if (steps_to_move == 0) {
+		return true;
+	}
+
+	// snapshot the move this one will follow
+	noInterrupts();
+	prevRunning = _queue_count == 0;
+	if (prevRunning) {
+		prev = _move;
+	}
+	else {
+		prev = _queue[(_queue_head + _queue_count - 1) & (STEPPER_QUEUE_SIZE - 1)];
+	}
+	bool idle = prevRunning && !_running;
+	interrupts();
+
+	if (idle) {
+		planMove(&move, steps_to_move, _speed, _accel, _decel, 0, 0);
+#ifdef STEPPER_USE_TIMER
+		_timer_count = 0;
+#endif
+		_ahead_count = 0;
+		_ahead_seq++;
+		loadMove(&move);
+#ifdef STEPPER_USE_TIMER
+		planAhead();
+#endif
+		return true;
+	}
+
+	junction_sq = junctionSq(&prev, steps_to_move, _speed, _accel, _decel);
+	if (junction_sq > 0) {
+		planMove(&prev, prev.direction == Stepper::CW ? prev.steps : -prev.steps,
+			prev.speed, prev.accel, prev.decel, prev.entry_sq, junction_sq);
+	}
+	planMove(&move, steps_to_move, _speed, _accel, _decel, junction_sq, 0);
+
+	noInterrupts();
+	if (junction_sq > 0 && !applyExit(&prev, prevRunning)) {
+		// the previous move is already slowing down to stop, so start from rest
+		interrupts();
+		planMove(&move, steps_to_move, _speed, _accel, _decel, 0, 0);
+		noInterrupts();
+	}
+	_queue[(_queue_head + _queue_count) & (STEPPER_QUEUE_SIZE - 1)] = move;
+	_queue_count++;
+	// the previous move may have finished while this one was being planned
+	if (!_running) {
+		startQueuedMove();
+	}
+	interrupts();
+#ifdef STEPPER_USE_TIMER
+	// a new exit throws the delays worked out ahead away, get them back now
+	planAhead();
+#endif
+
+	return true;
+}
+
+/**
+ * @return The number of moves waiting in the queue.
+ */
+byte Stepper::getQueueDepth() {
+	return _queue_count;
+}
+
+/**
+ * Replace the exit of the move that precedes a newly queued one with the
+ * junction speed, throwing away the ramp delays worked out for the old one.
+ * Must be called with interrupts disabled.
+ * @return false if the move has gone past the point where it could still
+ * reach the new exit speed
+ * @private
+ */
+bool Stepper::applyExit(StepperMove *prev, bool running) {
+	if (!running) {
+		if (_queue_count == 0) {
+			// it was started while we were planning
+			return false;
+		}
+		_queue[(_queue_head + _queue_count - 1) & (STEPPER_QUEUE_SIZE - 1)] = *prev;
+	}
+	else {
+		if (!_running || _move.seq != prev->seq ||
+			(_run_state != Stepper::ACCEL && _run_state != Stepper::RUN) ||
+			(long)_stepCount >= prev->decel_start) {
+			return false;
+		}
+		_move = *prev;
+		_decel_start = prev->decel_start;
+		_decel_val = prev->decel_val;
+		_exit_count = prev->exit_count;
+	}
+	_ahead_count = 0;
+	_ahead_seq++;
+	return true;
+}
+
+/**
+ * Work out how fast a move can leave into the next one, as the speed squared
+ * in (0.01*rad/sec)^2. Both moves need ramps and must go the same way, the
+ * junction is no faster than either move's max speed, no faster than the
+ * first move can accelerate to and slow enough that the next move can still
+ * stop by its end.
+ * @private
+ */
+unsigned long Stepper::junctionSq(StepperMove *prev, long steps_to_move, int speed, int accel, int decel) {
+	byte direction = steps_to_move < 0 ? Stepper::CCW : Stepper::CW;
+	unsigned long steps = steps_to_move < 0 ? -steps_to_move : steps_to_move;
+	unsigned long sq;
+	unsigned long unit;
+
+	if (prev->accel == 0 || prev->decel == 0 || accel == 0 || decel == 0 ||
+		prev->steps < 2 || steps < 2 || prev->direction != direction) {
+		return 0;
+	}
+
+	sq = (unsigned long)speed * speed;
+	if ((unsigned long)prev->speed * prev->speed < sq) {
+		sq = (unsigned long)prev->speed * prev->speed;
+	}
+
+	unit = rampUnit(prev->accel);
+	if (sq > prev->entry_sq && (sq - prev->entry_sq) / unit > (unsigned long)prev->steps) {
+		sq = prev->entry_sq + prev->steps * unit;
+	}
+
+	unit = rampUnit(decel);
+	if (sq / unit > steps) {
+		sq = steps * unit;
+	}
+	return sq;
+}
+
+/**
+ * Squared speed gained per step at the given acceleration, so that
+ * speed^2 / rampUnit(accel) is the number of steps needed to reach speed.
+ * @private
+ */
+unsigned long Stepper::rampUnit(int accel) {
+	unsigned long unit = ((long)_ax20000 * accel) / 100;
+	return unit > 0 ? unit : 1;
+}
+
+/**
+ * Integer square root, rounded to nearest.
+ */
+static unsigned long isqrt(unsigned long x) {
+	unsigned long root = 0;
+	unsigned long bit = 1UL << 30;
+
+	while (bit > x) {
+		bit >>= 2;
+	}
+	while (bit != 0) {
+		if (x >= root + bit) {
+			x -= root + bit;
+			root = (root >> 1) + bit;
+		}
+		else {
+			root >>= 1;
+		}
+		bit >>= 2;
+	}
+	// x is left with the remainder, round up past root + 0.5
+	if (x > root) {
+		root++;
+	}
+	return root;
+}
+
+/**
+ * Delay before the first step of a move that starts from rest.
+ *
+ * step_delay = 1/tt * sqrt(2*alpha/accel)
+ * step_delay = ( tfreq*0.676/100 )*100 * sqrt( (2*alpha*10000000000) / (accel*100) )/10000
+ * which with alpha = 2*PI/steps_per_rev is C0_SCALE / sqrt(steps_per_rev*accel).
+ *
+ * The square root is taken with up to 15 fractional bits and the division is
+ * done in two parts so the scaled numerator doesn't overflow. For every
+ * steps_per_rev and accel up to 16383 the result is the exact value rounded
+ * to whole micros, give or take 0.002%, see test/stepper_math_test.cpp.
+ * @private
+ */
+unsigned long Stepper::initialDelay(int accel) {
+	unsigned long x = (unsigned long)_steps_per_rev * accel;
+	byte shift = 15;
+
+	// x << (2 * shift) must fit in 32 bits
+	while (shift > 0 && x >= (1UL << (32 - 2 * shift))) {
+		shift--;
+	}
+	unsigned long root = isqrt(x << (2 * shift));
+	// the remainder is below root < 2^16, so it can take the shift
+	return ((C0_SCALE / root) << shift) + (((C0_SCALE % root) << shift) + root / 2) / root;
+}
+
+#if STEPPER_RAMP_TABLES > 0
+StepperRamp Stepper::_ramps[STEPPER_RAMP_TABLES];
+#endif
+
+/**
+ * Find the ramp table for a profile, or claim a free one.
+ * Tables are never evicted while the steppers exist, since a running move
+ * may be replaying one; they are released by clearRampTables().
+ * @private
+ */
+StepperRamp *Stepper::findRamp(int speed, int accel, int decel, int decel_top, bool allocate) {
+#if STEPPER_RAMP_TABLES > 0
+	StepperRamp *free = NULL;
+
+	for (byte i = 0; i < STEPPER_RAMP_TABLES; i++) {
+		StepperRamp *ramp = &_ramps[i];
+		if (ramp->steps_per_rev == 0) {
+			if (free == NULL) {
+				free = ramp;
+			}
+		}
+		else if (ramp->steps_per_rev == _steps_per_rev && ramp->speed == speed &&
+			ramp->accel == accel && ramp->decel == decel) {
+			return ramp;
+		}
+	}
+	if (allocate && free != NULL) {
+		free->ready = 0;
+		free->speed = speed;
+		free->accel = accel;
+		free->decel = decel;
+		free->accel_top = 0;
+		free->decel_top = decel_top;
+		free->steps_per_rev = _steps_per_rev;
+		return free;
+	}
+#endif
+	return NULL;
+}
+
+/**
+ * Forget all recorded ramp tables. Only call this when no stepper is moving,
+ * for example after all steppers have been deleted.
+ */
+void Stepper::clearRampTables() {
+#if STEPPER_RAMP_TABLES > 0
+	for (byte i = 0; i < STEPPER_RAMP_TABLES; i++) {
+		_ramps[i].steps_per_rev = 0;
+	}
+#endif
+}
+
+/**
+ * Compute the acceleration profile of a move.
+ *
+ * @param move Receives the profile
+ * @param steps_to_move The signed number of steps
+ * @param speed Max speed in 0.01*rad/sec
+ * @param accel Acceleration in 0.01*rad/sec^2
+ * @param decel Deceleration in 0.01*rad/sec^2
+ * @param entry_sq Squared speed the move starts at, 0 from rest
+ * @param exit_sq Squared speed the move ends at, 0 to stop
+ * @private
+ */
+void Stepper::planMove(StepperMove *move, long steps_to_move, int speed, int accel, int decel,
+	unsigned long entry_sq, unsigned long exit_sq) {
+	unsigned long maxStepLimit;
+	long accelerationLimit;
+	long entryCount = 0;
+	long exitCount = 0;
+
+	move->speed = speed;
+	move->accel = accel;
+	move->decel = decel;
+	move->entry_sq = entry_sq;
+	move->ramp = NULL;
+	move->accel_count = 0;
+	move->decel_val = 0;
+	move->exit_count = 0;
+
 	if (steps_to_move < 0) {
-		_direction = Stepper::CCW;
+		move->direction = Stepper::CCW;
 		steps_to_move = -steps_to_move;
 	}
 	else {
-		_direction = Stepper::CW;
+		move->direction = Stepper::CW;
 	}
 
-	_steps_to_move = steps_to_move;
+	move->steps = steps_to_move;
 
 	// set max speed limit, by calc min_delay
 	// min_delay = (alpha / tt)/w
-	_min_delay = _at_x100 / _speed;
+	move->min_delay = _at_x100 / speed;
 
 	// if acceleration or deceleration are not defined
 	// start in RUN state and do no decelerate
-	if (_accel == 0 || _decel == 0) {
-		_step_delay = _min_delay;
-
-		_decel_start = _steps_to_move;
-		_run_state = Stepper::RUN;
-		_accel_count = 0;
-		_running = true;
-
+	if (accel == 0 || decel == 0) {
+		move->step_delay = move->min_delay;
+		move->decel_start = move->steps;
+		move->run_state = Stepper::RUN;
 		return;
 	}
 
 	// if only moving 1 step
-	if (_steps_to_move == 1) {
-
+	if (move->steps <= 1) {
 		// move one step
-		_accel_count = -1;
-		_run_state = Stepper::DECEL;
+		move->accel_count = -1;
+		move->decel_start = 0;
+		move->run_state = move->steps == 1 ? Stepper::DECEL : Stepper::STOP;
+		move->step_delay = move->min_delay;
+		return;
+	}
 
-		_step_delay = _min_delay;
-		_running = true;
+	// a move that continues from the previous one starts part way up the ramp
+	if (entry_sq > 0) {
+		entryCount = entry_sq / rampUnit(accel);
+		move->step_delay = _at_x100 / (long)isqrt(entry_sq);
+	}
+	else {
+		move->step_delay = initialDelay(accel);
+	}
+	// and a move that continues into the next one stops part way down
+	if (exit_sq > 0) {
+		exitCount = exit_sq / rampUnit(decel);
 	}
-	else if (_steps_to_move != 0) {
-		// set initial step delay
-		// step_delay = 1/tt * sqrt(2*alpha/accel)
-		// step_delay = ( tfreq*0.676/100 )*100 * sqrt( (2*alpha*10000000000) / (accel*100) )/10000
-		_step_delay = (long)((T1_FREQ_148 * sqrt(_alpha_x2 / _accel)) * 1000);
 
-		// find out after how many steps does the speed hit the max speed limit.
-		// maxSpeedLimit = speed^2 / (2*alpha*accel)
-		maxStepLimit = (long)_speed*_speed / (long)(((long)_ax20000*_accel) / 100);
+	// find out after how many steps does the speed hit the max speed limit.
+	// maxSpeedLimit = speed^2 / (2*alpha*accel)
+	maxStepLimit = (long)speed*speed / rampUnit(accel);
 
-		// if we hit max spped limit before 0.5 step it will round to 0.
-		// but in practice we need to move at least 1 step to get any speed at all.
-		if (maxStepLimit == 0) {
-			maxStepLimit = 1;
-		}
+	// if we hit max spped limit before 0.5 step it will round to 0.
+	// but in practice we need to move at least 1 step to get any speed at all.
+	if (maxStepLimit == 0) {
+		maxStepLimit = 1;
+	}
 
-		// find out after how many steps we must start deceleration.
-		// n1 = (n1+n2)decel / (accel + decel)
-		accelerationLimit = (long)((_steps_to_move*_decel) / (_accel + _decel));
+	// find out after how many steps we must start deceleration.
+	// n1 = (n1+n2)decel / (accel + decel), counting the part of the ramps
+	// that lies before the entry and after the exit
+	accelerationLimit = (long)(((move->steps + entryCount + exitCount)*decel) / (accel + decel)) - entryCount;
 
-		// we must accelerate at least 1 step before we can start deceleration
-		if (accelerationLimit == 0) {
-			accelerationLimit = 1;
-		}
+	// we must accelerate at least 1 step before we can start deceleration
+	if (accelerationLimit <= 0) {
+		accelerationLimit = 1;
+	}
 
-		// use the limit we hit first to calc decel
-		if (accelerationLimit <= maxStepLimit) {
-			_decel_val = accelerationLimit - _steps_to_move;
-		}
-		else {
-			_decel_val = -(long)(maxStepLimit*_accel) / _decel;
-		}
+	// use the limit we hit first to calc decel
+	if (accelerationLimit + entryCount <= (long)maxStepLimit) {
+		move->decel_val = accelerationLimit - move->steps - exitCount;
+	}
+	else {
+		move->decel_val = -(long)(maxStepLimit*accel) / decel;
+	}
 
-		// we must decelerate at least 1 step to stop
-		if (_decel_val == 0) {
-			_decel_val = -1;
-		}
+	// only a move that starts from rest can record the acceleration ramp
+	move->ramp = findRamp(speed, accel, decel, (long)(maxStepLimit*accel) / decel, entry_sq == 0);
 
-		// find step to start deceleration
-		_decel_start = _steps_to_move + _decel_val;
+	// we must decelerate at least 1 step to stop
+	if (move->decel_val + exitCount >= 0) {
+		move->decel_val = -exitCount - 1;
+	}
 
-		// if the max spped is so low that we don't need to go via acceleration state.
-		if (_step_delay <= _min_delay) {
-			_step_delay = _min_delay;
-			_run_state = Stepper::RUN;
-		}
-		else {
-			_run_state = Stepper::ACCEL;
+	// find step to start deceleration
+	move->decel_start = move->steps + move->decel_val + exitCount;
+	move->exit_count = exitCount;
+	move->accel_count = entryCount;
+
+	// if the max spped is so low that we don't need to go via acceleration state.
+	if (move->step_delay <= (unsigned long)move->min_delay) {
+		move->step_delay = move->min_delay;
+		move->run_state = Stepper::RUN;
+	}
+	else {
+		move->run_state = Stepper::ACCEL;
+	}
+}
+
+/**
+ * Make a planned move the current one and start the timer if need be. Safe
+ * to call from the timer interrupt.
+ * @private
+ */
+void Stepper::loadMove(StepperMove *move) {
+	move->seq = ++_move_seq;
+	_move = *move;
+
+	_direction = move->direction;
+	_steps_to_move = move->steps;
+	_min_delay = move->min_delay;
+	_step_delay = move->step_delay;
+	_run_state = move->run_state;
+	_accel_count = move->accel_count;
+	_decel_start = move->decel_start;
+	_decel_val = move->decel_val;
+	_exit_count = move->exit_count;
+	// deceleration from RUN starts at the max speed delay
+	_lastAccelDelay = move->min_delay;
+	_stepCount = 0;
+	_rest = 0;
+	_position += move->direction == Stepper::CW ? move->steps : -move->steps;
+	_ramp = move->ramp;
+	_ramp_record = 0;
+	if (_ramp != NULL && move->entry_sq == 0) {
+		_ramp_record = RAMP_FROM_REST;
+		if (!(_ramp->ready & RAMP_ACCEL)) {
+			_ramp_record |= RAMP_ACCEL;
 		}
+	}
 
-		// reset counter
-		_accel_count = 0;
-		_running = true;
+	_running = move->run_state != Stepper::STOP;
+#ifdef STEPPER_USE_TIMER
+	if (_running) {
+		startTimer();
 	}
+#endif
 }
 
+/**
+ * Start the next queued move, if any.
+ * Must be called with interrupts disabled or from the timer interrupt.
+ * @return true if a move was started
+ * @private
+ */
+bool Stepper::startQueuedMove() {
+	if (_queue_count == 0) {
+		return false;
+	}
+	loadMove(&_queue[_queue_head]);
+	_queue_head = (_queue_head + 1) & (STEPPER_QUEUE_SIZE - 1);
+	_queue_count--;
+	return true;
+}
 
-bool Stepper::update() {
-	bool done = false;
-	long newStepDelay;
 
+bool Stepper::update() {
 	if (_limit_switch_a > 0) {
 		if (digitalRead(_limit_switch_a) == _switch_a_type){
 			_a_tripped = true;
@@ -308,87 +771,513 @@ bool Stepper::update() {
 		}
 	}
 
-
+#ifdef STEPPER_USE_TIMER
+	// the steps are taken by timerTick(), work out the delays it needs and
+	// report completion here
+	planAhead();
+	if (_done) {
+		_done = false;
+		return true;
+	}
+	return false;
+#else
 	unsigned long curTimeVal = micros();
 	long timeDiff = curTimeVal - _last_step_time;
 
 	if (_running == true && timeDiff >= _step_delay) {
-
 		_last_step_time = curTimeVal;
+		return step();
+	}
+	return false;
+#endif
+}
+
+/**
+ * Next delay of an acceleration or deceleration ramp after ramp step n
+ * (negative while decelerating), carrying the remainder of the division.
+ */
+static long rampStep(unsigned long delay, unsigned int *rest, int n) {
+	long newDelay = delay - (((2 * (long)delay) + *rest) / (4 * n + 1));
+	*rest = ((2 * (long)delay) + *rest) % (4 * n + 1);
+	return newDelay < 0 ? -newDelay : newDelay;
+}
+
+/**
+ * @return true if the delay after ramp step accel_count of a move in
+ * run_state can be replayed from its recorded ramp.
+ * @private
+ */
+bool Stepper::replayRamp(StepperRamp *ramp, byte run_state, int accel_count) {
+	if (ramp == NULL) {
+		return false;
+	}
+	if (run_state == Stepper::ACCEL) {
+		return (ramp->ready & RAMP_ACCEL) && accel_count <= ramp->accel_top &&
+			accel_count > ramp->accel_top - STEPPER_RAMP_TABLE_SIZE;
+	}
+	return (ramp->ready & RAMP_DECEL) && -accel_count < ramp->decel_top &&
+		-accel_count >= ramp->decel_top - STEPPER_RAMP_TABLE_SIZE;
+}
+
+/**
+ * Delay after ramp step accel_count of a move in run_state that follows a
+ * step of the given delay, replayed from the recorded ramp or else divided
+ * out, carrying the remainder in rest.
+ * @private
+ */
+long Stepper::rampValue(StepperRamp *ramp, byte run_state, int accel_count,
+	unsigned long delay, unsigned int *rest) {
+	if (replayRamp(ramp, run_state, accel_count)) {
+		if (run_state == Stepper::ACCEL) {
+			*rest = 0;
+			return ramp->accel_delay[accel_count & (STEPPER_RAMP_TABLE_SIZE - 1)];
+		}
+		// pick up the division exactly where the table ends
+		*rest = -accel_count == ramp->decel_top - STEPPER_RAMP_TABLE_SIZE ? ramp->decel_rest : 0;
+		return ramp->decel_delay[-accel_count & (STEPPER_RAMP_TABLE_SIZE - 1)];
+	}
+	return rampStep(delay, rest, accel_count);
+}
 
-		switch (_run_state) {
-		case Stepper::STOP:
-			_stepCount = 0;
+/**
+ * Delay after the ramp step being taken: worked out ahead by planAhead(),
+ * or else replayed or divided out here.
+ * @private
+ */
+long Stepper::rampDelay() {
+	if (aheadReady(_stepCount)) {
+		StepperRampDelay *ahead = &_ahead[_ahead_head];
+		_ahead_head = (_ahead_head + 1) & (STEPPER_RAMP_AHEAD - 1);
+		_ahead_count--;
+		_rest = ahead->rest;
+		return ahead->delay;
+	}
+	return rampValue(_ramp, _run_state, _accel_count, _step_delay, &_rest);
+}
+
+/**
+ * Take the next step of the move and compute the delay until the one after.
+ * @return true if the move has completed.
+ * @private
+ */
+bool Stepper::step() {
+	bool done = false;
+	long newStepDelay;
+
+	switch (_run_state) {
+	case Stepper::STOP:
+		// a move queued after the last one finished can still go without
+		// reporting done in between
+		if (startQueuedMove()) {
+			return false;
+		}
+		_stepCount = 0;
+		_rest = 0;
+		if (_running) {
+			done = true;
+		}
+		_running = false;
+		// nothing left to do, keep the current delay
+		return done;
+
+	case Stepper::ACCEL:
+		updateStepPosition();
+		_stepCount++;
+		_accel_count++;
+		newStepDelay = rampDelay();
+		if (_ramp_record & RAMP_ACCEL) {
+			_ramp->accel_delay[_accel_count & (STEPPER_RAMP_TABLE_SIZE - 1)] = newStepDelay;
+		}
+
+		// check if we should start deceleration
+		if (_stepCount >= _decel_start) {
+			_accel_count = _decel_val;
+			_run_state = Stepper::DECEL;
 			_rest = 0;
-			if (_running) {
-				done = true;
+			// the deceleration did not start from max speed
+			_ramp_record = 0;
+		}
+		// check if we hit max speed
+		else if (newStepDelay <= _min_delay) {
+			_lastAccelDelay = newStepDelay;
+			newStepDelay = _min_delay;
+			_rest = 0;
+			_run_state = Stepper::RUN;
+			if (_ramp_record & RAMP_ACCEL) {
+				_ramp->accel_top = _accel_count;
+				_ramp->ready |= RAMP_ACCEL;
 			}
-			_running = false;
-			break;
+		}
+		break;
 
-		case Stepper::ACCEL:
-			updateStepPosition();
-			_stepCount++;
-			_accel_count++;
-			newStepDelay = _step_delay - (((2 * (long)_step_delay) + _rest) / (4 * _accel_count + 1));
-			_rest = ((2 * (long)_step_delay) + _rest) % (4 * _accel_count + 1);
-
-			// check if we should start deceleration
-			if (_stepCount >= _decel_start) {
-				_accel_count = _decel_val;
-				_run_state = Stepper::DECEL;
-				_rest = 0;
-			}
-			// check if we hit max speed
-			else if (newStepDelay <= _min_delay) {
-				_lastAccelDelay = newStepDelay;
-				newStepDelay = _min_delay;
-				_rest = 0;
-				_run_state = Stepper::RUN;
+	case Stepper::RUN:
+		updateStepPosition();
+		_stepCount++;
+		newStepDelay = _min_delay;
+
+		// if no accel or decel was specified, go directly to STOP state
+		if (_stepCount >= _steps_to_move) {
+			_run_state = Stepper::STOP;
+		}
+		// check if we should start deceleration
+		else if (_stepCount >= _decel_start) {
+			_accel_count = _decel_val;
+			// start deceleration with same delay that accel ended with
+			newStepDelay = _lastAccelDelay;
+			_run_state = Stepper::DECEL;
+			// a full deceleration to rest after a recorded acceleration
+			// can be recorded as well
+			_ramp_record = ((_ramp_record & RAMP_FROM_REST) && _exit_count == 0 &&
+				-_decel_val == _ramp->decel_top && !(_ramp->ready & RAMP_DECEL)) ? RAMP_DECEL : 0;
+		}
+		break;
+
+	case Stepper::DECEL:
+		updateStepPosition();
+		_stepCount++;
+		_accel_count++;
+		newStepDelay = rampDelay();
+
+		if (_ramp_record & RAMP_DECEL) {
+			_ramp->decel_delay[-_accel_count & (STEPPER_RAMP_TABLE_SIZE - 1)] = newStepDelay;
+			// done once the fast end of the ramp has been recorded
+			if (-_accel_count <= _ramp->decel_top - STEPPER_RAMP_TABLE_SIZE || _accel_count >= 0) {
+				_ramp->decel_rest = _rest;
+				_ramp->ready |= RAMP_DECEL;
+				_ramp_record = 0;
 			}
-			break;
+		}
+		// check if we are at the last step, or at the exit speed of a move
+		// that continues into the next one
+		if (_accel_count >= -_exit_count) {
+			_run_state = Stepper::STOP;
+		}
 
-		case Stepper::RUN:
-			updateStepPosition();
-			_stepCount++;
-			newStepDelay = _min_delay;
+		break;
+	}
+
+	_step_delay = newStepDelay;
+
+	// carry straight on into the next queued move
+	if (_run_state == Stepper::STOP) {
+		startQueuedMove();
+	}
+
+	return done;
+}
+
+Stepper *Stepper::_timed[STEPPER_MAX_TIMED];
+byte Stepper::_timed_count = 0;
+
+#ifdef STEPPER_USE_TIMER
+
+static volatile bool timerRunning = false;
+static byte savedTCCR2A;
+static byte savedTCCR2B;
+static byte savedOCR2A;
+
+/**
+ * Start Timer2 in CTC mode with a /8 prescaler so it fires every
+ * STEPPER_TIMER_TICK microseconds, unless it already runs.
+ * @private
+ */
+void Stepper::startTimer() {
+	if (!timerRunning) {
+		savedTCCR2A = TCCR2A;
+		savedTCCR2B = TCCR2B;
+		savedOCR2A = OCR2A;
+		TCCR2A = (1 << WGM21);
+		TCCR2B = (1 << CS21);
+		OCR2A = (F_CPU / 8 / 1000000L) * STEPPER_TIMER_TICK - 1;
+		TCNT2 = 0;
+		TIFR2 = (1 << OCF2A);
+		TIMSK2 |= (1 << OCIE2A);
+		timerRunning = true;
+	}
+}
+
+/**
+ * Stop the timer interrupt and give Timer2 its previous setup back.
+ * @private
+ */
+void Stepper::stopTimer() {
+	if (timerRunning) {
+		TIMSK2 &= ~(1 << OCIE2A);
+		TCCR2B = savedTCCR2B;
+		TCCR2A = savedTCCR2A;
+		OCR2A = savedOCR2A;
+		timerRunning = false;
+	}
+}
+
+ISR(TIMER2_COMPA_vect) {
+	Stepper::timerTick();
+}
+
+#endif
+
+/**
+ * Find a move of the running one and those queued after it by its seq.
+ * Must be called with interrupts disabled.
+ * @return false if there is no such move (yet)
+ * @private
+ */
+bool Stepper::plannedMove(byte seq, StepperMove *move) {
+	// queued moves get their seq in order as they are started
+	byte ahead = seq - _move.seq;
 
-			// if no accel or decel was specified, go directly to STOP state
-			if (_stepCount >= _steps_to_move) {
-				_run_state = Stepper::STOP;
+	if (ahead == 0) {
+		*move = _move;
+		return true;
+	}
+	if (ahead > _queue_count) {
+		return false;
+	}
+	*move = _queue[(_queue_head + ahead - 1) & (STEPPER_QUEUE_SIZE - 1)];
+	return true;
+}
+
+/**
+ * Work out the delays of the coming ramp steps ahead of the timer interrupt,
+ * with interrupts enabled, until STEPPER_RAMP_AHEAD of them wait. This
+ * follows the steps of the running move the way step() will take them, and
+ * carries on into the queued moves, so the interrupt doesn't wait for a
+ * ramp step as long as update() comes round before they are used up.
+ * Called by update() and whenever a move is set.
+ * @private
+ */
+void Stepper::planAhead() {
+	StepperMove move;
+	byte seq;
+	StepperRampDelay next;
+
+	noInterrupts();
+	if (!_running || _ahead_count >= STEPPER_RAMP_AHEAD) {
+		interrupts();
+		return;
+	}
+	if (_ahead_count == 0) {
+		// start over from the step the interrupt is at
+		_plan_seq = _move.seq;
+		_plan_state = _run_state;
+		_plan_step = _stepCount;
+		_plan_accel_count = _accel_count;
+		_plan_delay = _run_state == Stepper::RUN ? _lastAccelDelay : _step_delay;
+		_plan_rest = _rest;
+	}
+	if (!plannedMove(_plan_seq, &move)) {
+		// the moves planned for have gone, start over next time
+		_ahead_count = 0;
+		_ahead_seq++;
+		interrupts();
+		return;
+	}
+	seq = _ahead_seq;
+	interrupts();
+
+	for (;;) {
+		byte state = _plan_state;
+		int n = _plan_accel_count;
+		unsigned long stepCount = _plan_step;
+		unsigned long delay = _plan_delay;
+		unsigned int rest = _plan_rest;
+		bool found = false;
+
+		if (state == Stepper::ACCEL || state == Stepper::DECEL) {
+			stepCount++;
+			n++;
+			delay = rampValue(move.ramp, state, n, delay, &rest);
+			next.delay = delay;
+			next.rest = rest;
+			next.step = stepCount;
+			next.seq = _plan_seq;
+			found = true;
+			// the state changes of step()
+			if (state == Stepper::ACCEL) {
+				if ((long)stepCount >= move.decel_start) {
+					state = Stepper::DECEL;
+					n = move.decel_val;
+					rest = 0;
+				}
+				else if ((long)delay <= move.min_delay) {
+					// delay is where the deceleration will start from
+					state = Stepper::RUN;
+					rest = 0;
+				}
 			}
-			// check if we should start deceleration
-			else if (_stepCount >= _decel_start) {
-				_accel_count = _decel_val;
-				// start deceleration with same delay that accel ended with
-				newStepDelay = _lastAccelDelay;
-				_run_state = Stepper::DECEL;
+			else if (n >= -move.exit_count) {
+				state = Stepper::STOP;
 			}
-			break;
+		}
+		else if (state == Stepper::RUN) {
+			// skip the steps at max speed
+			unsigned long decelStep = (long)stepCount + 1 > move.decel_start ? stepCount + 1 : move.decel_start;
+			if ((long)decelStep >= move.steps) {
+				state = Stepper::STOP;
+			}
+			else {
+				state = Stepper::DECEL;
+				stepCount = decelStep;
+				n = move.decel_val;
+				rest = 0;
+			}
+		}
 
-		case Stepper::DECEL:
-			updateStepPosition();
-			_stepCount++;
-			_accel_count++;
+		noInterrupts();
+		// the interrupt has thrown the plan away
+		if (seq != _ahead_seq) {
+			interrupts();
+			return;
+		}
+		if (state == Stepper::STOP && !found) {
+			// on to the next queued move
+			if (!plannedMove(_plan_seq + 1, &move)) {
+				interrupts();
+				return;
+			}
+			_plan_seq++;
+			state = move.run_state;
+			stepCount = 0;
+			n = move.accel_count;
+			delay = state == Stepper::RUN ? move.min_delay : move.step_delay;
+			rest = 0;
+		}
+		_plan_state = state;
+		_plan_accel_count = n;
+		_plan_step = stepCount;
+		_plan_delay = delay;
+		_plan_rest = rest;
+		if (found) {
+			_ahead[(_ahead_head + _ahead_count) & (STEPPER_RAMP_AHEAD - 1)] = next;
+			_ahead_count++;
+			if (_ahead_count >= STEPPER_RAMP_AHEAD) {
+				interrupts();
+				return;
+			}
+		}
+		interrupts();
+	}
+}
 
-			newStepDelay = _step_delay - (((2 * (long)_step_delay) + _rest) / (4 * _accel_count + 1));
-			_rest = ((2 * (long)_step_delay) + _rest) % (4 * _accel_count + 1);
+/**
+ * @return true if the next ramp delay worked out ahead is the one for the
+ * given step of the running move. If it is for another move or step the
+ * plan has gone wrong and is thrown away.
+ * @private
+ */
+bool Stepper::aheadReady(unsigned long stepCount) {
+	if (_ahead_count == 0) {
+		return false;
+	}
+	StepperRampDelay *ahead = &_ahead[_ahead_head];
+	if (ahead->seq == _move.seq && ahead->step == (unsigned int)stepCount) {
+		return true;
+	}
+	_ahead_count = 0;
+	_ahead_seq++;
+	return false;
+}
 
-			if (newStepDelay < 0) newStepDelay = -newStepDelay;
-			// check if we are at the last step
-			if (_accel_count >= 0) {
-				_run_state = Stepper::STOP;
-			}
+/**
+ * @return true if the next step can be taken without a division.
+ * @private
+ */
+bool Stepper::stepReady() {
+	return (_run_state != Stepper::ACCEL && _run_state != Stepper::DECEL) ||
+		aheadReady(_stepCount + 1) || replayRamp(_ramp, _run_state, _accel_count + 1);
+}
 
-			break;
+/**
+ * Count one timer period towards the current step delay and step once it has
+ * elapsed. The overshoot is carried into the next step so the average rate
+ * stays exact: a step goes out on the first tick at or after its due time,
+ * up to one STEPPER_TIMER_TICK late, plus the latency of other interrupts
+ * and of the steppers stepped before it on the same tick. A tick is lost
+ * altogether when the interrupt takes longer than STEPPER_TIMER_TICK.
+ *
+ * A ramp step whose following delay planAhead() has not worked out yet
+ * waits for it, so if loop() falls so far behind that they run out the
+ * ramp stretches rather than catching up with a burst of steps.
+ * @private
+ */
+void Stepper::tick() {
+	if (!_running) {
+		return;
+	}
+	_timer_count += STEPPER_TIMER_TICK;
+	if (_timer_count >= _step_delay) {
+		if (!stepReady()) {
+			// step on the first tick after the delay is ready, no carry
+			_timer_count = _step_delay > STEPPER_TIMER_TICK ? _step_delay - STEPPER_TIMER_TICK : 0;
+			return;
 		}
+		_timer_count -= _step_delay;
+		if (step()) {
+			_done = true;
+		}
+	}
+}
 
-		_step_delay = newStepDelay;
+void Stepper::timerTick() {
+	byte running = 0;
 
+	for (byte i = 0; i < _timed_count; i++) {
+		_timed[i]->tick();
+		running |= _timed[i]->_running;
 	}
+#ifdef STEPPER_USE_TIMER
+	// nothing left to step, Timer2 goes back until loadMove() needs it
+	if (!running) {
+		stopTimer();
+	}
+#else
+	(void)running;
+#endif
+}
 
-	return done;
+/**
+ * Prepare to be stepped by the leader of a StepperGroup instead of running
+ * a profile of its own.
+ * @param steps_to_move The signed number of steps the leader will make us take
+ * @private
+ */
+void Stepper::follow(long steps_to_move) {
+	_running = false;
+	_queue_count = 0;
+	_ahead_count = 0;
+	_ahead_seq++;
+	_stepCount = 0;
+	_position += steps_to_move;
 
+	if (steps_to_move < 0) {
+		_direction = Stepper::CCW;
+		steps_to_move = -steps_to_move;
+	}
+	else {
+		_direction = Stepper::CW;
+	}
+	_steps_to_move = steps_to_move;
+}
+
+/**
+ * Take one step on behalf of the group leader.
+ * @private
+ */
+void Stepper::followStep() {
+	updateStepPosition();
+	_stepCount++;
+}
+
+/**
+ * Stop following the group leader, keeping only the steps already taken in
+ * the position. Must be called with interrupts disabled.
+ * @private
+ */
+void Stepper::stopFollowing() {
+	long left = _steps_to_move - _stepCount;
+
+	_position -= _direction == Stepper::CW ? left : -left;
+	_steps_to_move = _stepCount;
 }
 
 /**
@@ -413,6 +1302,11 @@ void Stepper::updateStepPosition() {
 
 	// step the motor to step number 0, 1, 2, or 3:
 	stepMotor(_step_number % 4, _direction);
+
+	// drag the followers of a coordinated move along
+	if (_group != NULL) {
+		_group->leaderStepped();
+	}
 }
 
 /**
@@ -426,6 +1320,38 @@ void Stepper::stepMotor(byte step_num, byte direction) {
 	//switch a is assumed to be in the LOW direction, b in the high
 	//are there limit switches? are they tripped? is the direction of movement towards them
 	if (!_areLimitSwitches || (!_a_tripped && !_b_tripped) || ((_a_tripped && direction == 1) || (_b_tripped && direction == 0))){
+#ifdef DIRECT_PIN_WRITE
+		if (_interface == Stepper::DRIVER) {
+			// the driver only needs the setup time when the direction changes
+			if (direction != _last_direction) {
+				if (direction) {
+					DIRECT_PIN_WRITE(_pin_reg[0], 0, _pin_mask[0]);
+				}
+				else {
+					DIRECT_PIN_WRITE(_pin_reg[0], _pin_mask[0], 0);
+				}
+				_last_direction = direction;
+				delayMicroseconds(1);
+			}
+			DIRECT_PIN_WRITE(_pin_reg[1], _pin_mask[1], 0);
+			delayMicroseconds(1);
+			DIRECT_PIN_WRITE(_pin_reg[1], 0, _pin_mask[1]);
+		}
+		else if (_one_port) {
+			DIRECT_PIN_WRITE(_pin_reg[0], _coil_mask & ~_coil_set[step_num], _coil_set[step_num]);
+		}
+		else {
+			byte numPins = _interface == Stepper::FOUR_WIRE ? 4 : 2;
+			for (byte i = 0; i < numPins; i++) {
+				if (_coil_set[step_num] & _pin_mask[i]) {
+					DIRECT_PIN_WRITE(_pin_reg[i], 0, _pin_mask[i]);
+				}
+				else {
+					DIRECT_PIN_WRITE(_pin_reg[i], _pin_mask[i], 0);
+				}
+			}
+		}
+#else
 		if (_interface == Stepper::DRIVER) {
 			digitalWrite(_dir_pin, direction);
 			delayMicroseconds(1);
@@ -481,6 +1407,7 @@ void Stepper::stepMotor(byte step_num, byte direction) {
 				break;
 			}
 		}
+#endif
 	}
 }
 
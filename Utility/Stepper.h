@@ -50,9 +50,120 @@
 #include "WProgram.h"
 #endif
 
+#include "utility/direct_pin_write.h"
+
 #define T1_FREQ 1000000L // provides the most accurate step delay values
 #define T1_FREQ_148 ((long)((T1_FREQ*0.676)/100)) // divided by 100 and scaled by 0.676
 
+// the alpha (2 * PI / steps_per_rev) based constants are kept as integers so
+// no float math is needed on AVR, rounded to nearest
+#define ALPHA_T1_FREQ_X100 628318531UL  // 2 * PI * T1_FREQ * 100
+#define ALPHA_X20000 125664UL            // 2 * PI * 20000
+#define C0_SCALE 23963576UL              // T1_FREQ_148 * 1000 * sqrt(4 * PI)
+
+// On AVR boards with a Timer2 the steps are generated from the Timer2 compare
+// interrupt so step timing does not depend on how long loop() takes. Define
+// STEPPER_DO_NOT_USE_TIMER before including this file to fall back to polling
+// micros() from update(). The timer runs from the start of a move until no
+// stepper is running or has a move queued; meanwhile tone() and PWM on the
+// Timer2 pins (3 and 11 on an Uno, 9 and 10 on a Mega) can't be used.
+//
+// Each tick calls tick() on every stepper that exists, which returns at
+// once for an idle one; a step adds the pin writes and, on a ramp, taking
+// the delay update() worked out ahead. test/stepper_timer_test.cpp counts
+// the ticks and times them on the host.
+#if defined(__AVR__) && defined(TIMER2_COMPA_vect) && !defined(STEPPER_DO_NOT_USE_TIMER)
+#define STEPPER_USE_TIMER
+#endif
+
+#define STEPPER_TIMER_TICK 25 // timer interrupt period in microseconds
+#define STEPPER_MAX_TIMED 6   // max number of steppers driven by the timer
+
+#ifndef STEPPER_QUEUE_SIZE
+#define STEPPER_QUEUE_SIZE 4  // queued moves per motor, must be a power of 2
+#endif
+
+// Ramp delays worked out ahead of the timer interrupt by update(), per
+// motor. update() plans the running move and the queued ones step by step,
+// so the interrupt never divides and a ramp keeps its timing as long as
+// loop() comes round before these delays are used up. Must be a power of 2.
+#ifndef STEPPER_RAMP_AHEAD
+#if defined(__AVR__) && defined(RAMEND) && RAMEND < 0x1000
+#define STEPPER_RAMP_AHEAD 4
+#else
+#define STEPPER_RAMP_AHEAD 8
+#endif
+#endif
+
+// Number of ramp tables shared by all steppers. Each keeps the step delays
+// at the fast end of the acceleration and deceleration ramps of one
+// (steps_per_rev, speed, accel, decel) profile, recorded the first time
+// the profile runs, so repeated moves look them up instead of dividing.
+// That spares update() the divisions, and with the timer a looked up ramp
+// step doesn't wait even when the delays worked out ahead run out (see
+// test/stepper_ramp_bench.cpp).
+#ifndef STEPPER_RAMP_TABLES
+#if defined(__AVR__) && defined(RAMEND) && RAMEND < 0x1000
+#define STEPPER_RAMP_TABLES 0 // not enough RAM on the smaller AVRs
+#else
+#define STEPPER_RAMP_TABLES 2
+#endif
+#endif
+
+#ifndef STEPPER_RAMP_TABLE_SIZE
+#define STEPPER_RAMP_TABLE_SIZE 64 // delays kept per ramp, must be a power of 2
+#endif
+
+#define RAMP_ACCEL 0x01
+#define RAMP_DECEL 0x02
+#define RAMP_FROM_REST 0x04 // the running move follows the recorded profile
+
+struct StepperRamp {
+	int steps_per_rev;  // 0 while the table is unused
+	int speed;
+	int accel;
+	int decel;
+	int accel_top;      // accel_count at which max speed is reached
+	int decel_top;      // accel_count (negated) that a full deceleration starts at
+	volatile byte ready; // RAMP_ACCEL and / or RAMP_DECEL once recorded
+	unsigned int decel_rest; // division remainder where the decel table ends
+	// accel_delay[n & mask] is the delay after accel step n, for the last
+	// STEPPER_RAMP_TABLE_SIZE steps up to accel_top
+	unsigned long accel_delay[STEPPER_RAMP_TABLE_SIZE];
+	// decel_delay[m & mask] is the delay when m decel steps are left, for the
+	// first STEPPER_RAMP_TABLE_SIZE steps down from decel_top
+	unsigned long decel_delay[STEPPER_RAMP_TABLE_SIZE];
+};
+
+// a move with its acceleration profile already computed, ready to start
+struct StepperMove {
+	long steps;                // absolute number of steps
+	unsigned long entry_sq;    // squared speed the move starts at, 0 from rest
+	unsigned long step_delay;  // delay before the first step
+	StepperRamp *ramp;         // recorded ramp for this profile, if any
+	long min_delay;
+	long decel_start;
+	int speed;
+	int accel;
+	int decel;
+	int accel_count;
+	int decel_val;
+	int exit_count;            // deceleration stops this many steps short of rest
+	byte direction;
+	byte run_state;
+	byte seq;                  // identifies the move once it has been started
+};
+
+// a ramp delay worked out ahead by update() for the timer interrupt
+struct StepperRampDelay {
+	unsigned long delay;
+	unsigned int rest;
+	unsigned int step;         // low bits of the step count it is taken after
+	byte seq;                  // the move it belongs to
+};
+
+class StepperGroup;
+
 // library interface description
 class Stepper {
 public:
@@ -66,6 +177,7 @@ public:
 		byte lSwitchB = 0,
 		bool lSwitchAType = true,
 		bool lSwitchBType = true);
+	~Stepper();
 
 	enum Interface {
 		DRIVER = 1,
@@ -86,6 +198,10 @@ public:
 	};
 
 	void setStepsToMove(long steps_to_move, int speed = -1, int accel = -1, int decel = -1);
+	bool queueMove(long steps_to_move, int speed = -1, int accel = -1, int decel = -1);
+	byte getQueueDepth();
+
+	static void clearRampTables();
 
 	// update the stepper position
 	bool update();
@@ -101,10 +217,32 @@ public:
 
 	byte version(void);
 
+	// advance every running stepper by one timer tick, called from the ISR
+	static void timerTick();
+
 private:
+	friend class StepperGroup;
+
+	bool step();
+	long rampDelay();
+	static bool replayRamp(StepperRamp *ramp, byte run_state, int accel_count);
+	static long rampValue(StepperRamp *ramp, byte run_state, int accel_count,
+		unsigned long delay, unsigned int *rest);
+	void planMove(StepperMove *move, long steps_to_move, int speed, int accel, int decel,
+		unsigned long entry_sq, unsigned long exit_sq);
+	void loadMove(StepperMove *move);
+	bool startQueuedMove();
+	bool applyExit(StepperMove *prev, bool running);
+	unsigned long junctionSq(StepperMove *prev, long steps_to_move, int speed, int accel, int decel);
+	unsigned long rampUnit(int accel);
+	unsigned long initialDelay(int accel);
+	StepperRamp *findRamp(int speed, int accel, int decel, int decel_top, bool allocate);
+	void follow(long steps_to_move);
+	void followStep();
+	void stopFollowing();
 	void stepMotor(byte step_num, byte direction);
 	void updateStepPosition();
-	bool _running;
+	volatile bool _running;
 	byte _interface;     // Type of interface: DRIVER, TWO_WIRE or FOUR_WIRE
 	byte _direction;        // Direction of rotation
 	unsigned long _step_delay;    // delay between steps, in microseconds
@@ -135,10 +273,8 @@ private:
 	long _position;
 	unsigned int _rest;
 
-	float _alpha;  // PI * 2 / steps_per_rev
 	long _at_x100;  // alpha * T1_FREQ * 100
 	long _ax20000;  // alph a* 20000
-	float _alpha_x2;  // alpha * 2
 
 	// motor pin numbers:
 	byte _dir_pin;
@@ -149,6 +285,60 @@ private:
 	byte _motor_pin_4;
 
 	unsigned long _last_step_time; // time stamp in microseconds of when the last step was taken
+
+#ifdef DIRECT_PIN_WRITE
+	// output registers and bitmasks of the motor pins, like the Encoder
+	// caches its input pins, so a step does not go through digitalWrite()
+	volatile OUT_REG_TYPE *_pin_reg[4];
+	OUT_REG_TYPE _pin_mask[4];
+	OUT_REG_TYPE _coil_mask;       // all coil bits, when the coils share a port
+	OUT_REG_TYPE _coil_set[4];     // coil bits to set for each step_num
+	bool _one_port;
+	byte _last_direction;          // last level written to the dir pin
+#endif
+
+	StepperGroup *_group;          // set on the leader of a coordinated move
+
+	int _exit_count;               // steps short of rest at which DECEL ends
+	StepperMove _move;             // the move being run
+	byte _move_seq;
+	StepperMove _queue[STEPPER_QUEUE_SIZE];
+	byte _queue_head;
+	volatile byte _queue_count;
+
+	StepperRamp *_ramp;            // ramp table of the running move
+	byte _ramp_record;             // RAMP_ACCEL / RAMP_DECEL while recording, RAMP_FROM_REST
+#if STEPPER_RAMP_TABLES > 0
+	static StepperRamp _ramps[STEPPER_RAMP_TABLES];
+#endif
+
+	void tick();
+	bool stepReady();
+	bool aheadReady(unsigned long stepCount);
+	void planAhead();
+	bool plannedMove(byte seq, StepperMove *move);
+	volatile bool _done;           // set by the ISR when a move completes, cleared by update()
+	unsigned long _timer_count;    // microseconds elapsed since the last step
+
+	// ramp delays worked out ahead, taken by the ISR in order
+	StepperRampDelay _ahead[STEPPER_RAMP_AHEAD];
+	byte _ahead_head;
+	volatile byte _ahead_count;
+	volatile byte _ahead_seq;      // bumped when the delays ahead are thrown away
+	// where planAhead() has got to
+	byte _plan_seq;
+	byte _plan_state;
+	int _plan_accel_count;
+	unsigned long _plan_step;
+	unsigned long _plan_delay;
+	unsigned int _plan_rest;
+
+	static Stepper *_timed[STEPPER_MAX_TIMED];
+	static byte _timed_count;
+#ifdef STEPPER_USE_TIMER
+	static void startTimer();
+	static void stopTimer();
+#endif
 };
 
 #endif
\ No newline at end of file
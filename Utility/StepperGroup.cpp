@@ -0,0 +1,126 @@
+/**
+  StepperGroup moves several Stepper instances together along a straight
+  line. See StepperGroup.h.
+  */
+
+#include "StepperGroup.h"
+
+StepperGroup::StepperGroup() {
+	_numAxes = 0;
+	_leader = 0;
+	_leadSteps = 0;
+	_moving = false;
+}
+
+/**
+ * Forget all axes. A leader that is still moving keeps its own profile but
+ * no longer drives the followers, which stop where they are and only count
+ * the steps they have taken.
+ */
+void StepperGroup::clear() {
+	if (_moving) {
+		noInterrupts();
+		_axes[_leader]->_group = NULL;
+		for (byte i = 0; i < _numAxes; i++) {
+			if (i != _leader) {
+				_axes[i]->stopFollowing();
+			}
+		}
+		interrupts();
+	}
+	_numAxes = 0;
+	_leader = 0;
+	_leadSteps = 0;
+	_moving = false;
+}
+
+/**
+ * Add an axis to the next coordinated move.
+ * @param stepper The stepper to move
+ * @param steps_to_move The signed number of steps for this axis
+ * @return false if the group is full or the stepper is already part of it
+ */
+bool StepperGroup::addAxis(Stepper *stepper, long steps_to_move) {
+	if (_numAxes >= STEPPER_GROUP_MAX_AXES || stepper == NULL) {
+		return false;
+	}
+	if (contains(stepper)) {
+		return false;
+	}
+	long absSteps = steps_to_move < 0 ? -steps_to_move : steps_to_move;
+	if (_numAxes == 0 || absSteps > _leadSteps) {
+		_leader = _numAxes;
+		_leadSteps = absSteps;
+	}
+	_axes[_numAxes] = stepper;
+	_steps[_numAxes] = steps_to_move;
+	_numAxes++;
+	return true;
+}
+
+/**
+ * Start the coordinated move. The speed, acceleration and deceleration apply
+ * to the leader; the followers move proportionally slower.
+ * @return false if no axis has to move, the group is cleared then
+ */
+bool StepperGroup::start(int speed, int accel, int decel) {
+	if (_leadSteps == 0) {
+		clear();
+		return false;
+	}
+	for (byte i = 0; i < _numAxes; i++) {
+		// start at half a step so the rounding is symmetric along the line
+		_error[i] = _leadSteps / 2;
+		if (i != _leader) {
+			_axes[i]->follow(_steps[i]);
+		}
+	}
+	// attach the group before the leader starts so no follower step is missed
+	_axes[_leader]->_group = this;
+	_axes[_leader]->setStepsToMove(_steps[_leader], speed, accel, decel);
+	_moving = true;
+	return true;
+}
+
+bool StepperGroup::isLeader(Stepper *stepper) {
+	return _numAxes > 0 && _axes[_leader] == stepper;
+}
+
+bool StepperGroup::isFollower(Stepper *stepper) {
+	return contains(stepper) && !isLeader(stepper);
+}
+
+bool StepperGroup::contains(Stepper *stepper) {
+	for (byte i = 0; i < _numAxes; i++) {
+		if (_axes[i] == stepper) {
+			return true;
+		}
+	}
+	return false;
+}
+
+byte StepperGroup::nextStep() {
+	byte mask = 0;
+	for (byte i = 0; i < _numAxes; i++) {
+		if (i == _leader) {
+			mask |= (1 << i);
+			continue;
+		}
+		_error[i] += _steps[i] < 0 ? -_steps[i] : _steps[i];
+		if (_error[i] >= _leadSteps) {
+			_error[i] -= _leadSteps;
+			mask |= (1 << i);
+		}
+	}
+	return mask;
+}
+
+void StepperGroup::leaderStepped() {
+	byte mask = nextStep();
+	for (byte i = 0; i < _numAxes; i++) {
+		// a follower given its own move since the group started is left alone
+		if (i != _leader && (mask & (1 << i)) && !_axes[i]->_running) {
+			_axes[i]->followStep();
+		}
+	}
+}
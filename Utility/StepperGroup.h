@@ -0,0 +1,51 @@
+/*
+  StepperGroup moves several Stepper instances together along a straight
+  line. The axis with the most steps (the leader) runs the normal
+  acceleration / deceleration profile and the other axes (the followers)
+  are stepped from it with a Bresenham / DDA interpolator, so every axis
+  starts and stops on the same step of the leader.
+  */
+
+#ifndef StepperGroup_h
+#define StepperGroup_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#include "Stepper.h"
+
+#define STEPPER_GROUP_MAX_AXES 6
+
+class StepperGroup {
+public:
+	StepperGroup();
+
+	void clear();
+	bool addAxis(Stepper *stepper, long steps_to_move);
+	bool start(int speed = -1, int accel = -1, int decel = -1);
+
+	bool isLeader(Stepper *stepper);
+	bool isFollower(Stepper *stepper);
+	bool contains(Stepper *stepper);
+
+	// advance the interpolator by one leader step, returns a bitmask of the
+	// axes that must step with it
+	byte nextStep();
+
+	// called by the leader each time it takes a step
+	void leaderStepped();
+
+private:
+	Stepper *_axes[STEPPER_GROUP_MAX_AXES];
+	long _steps[STEPPER_GROUP_MAX_AXES];  // signed steps requested per axis
+	long _error[STEPPER_GROUP_MAX_AXES];  // Bresenham accumulator per axis
+	byte _numAxes;
+	byte _leader;                         // index of the axis with the most steps
+	long _leadSteps;                      // absolute steps of the leader
+	bool _moving;                         // started and not cleared yet
+};
+
+#endif
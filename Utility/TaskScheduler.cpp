@@ -0,0 +1,137 @@
+/*
+  TaskScheduler.cpp - cooperative tasks for loop(), see TaskScheduler.h
+  */
+
+#include "TaskScheduler.h"
+
+TaskScheduler::TaskScheduler()
+{
+	_numTasks = 0;
+	_passBudget = SCHEDULER_PASS_BUDGET;
+}
+
+signed char TaskScheduler::add(TaskFunction run, byte priority, unsigned long period, unsigned int budget)
+{
+	if (_numTasks >= SCHEDULER_MAX_TASKS) {
+		return -1;
+	}
+	byte id = _numTasks;
+	SchedulerTask *task = &_tasks[id];
+	task->run = run;
+	task->period = period;
+	task->due = micros() + period;
+	task->budget = budget;
+	task->priority = priority;
+	task->deferred = false;
+	task->catchUp = 0;
+	task->runs = 0;
+	task->skipped = 0;
+	task->maxLate = 0;
+
+	// insert after the tasks of the same or higher priority
+	byte pos = _numTasks;
+	while (pos > 0 && _tasks[_order[pos - 1]].priority > priority) {
+		_order[pos] = _order[pos - 1];
+		pos--;
+	}
+	_order[pos] = id;
+	_numTasks++;
+	return id;
+}
+
+void TaskScheduler::setPeriod(byte task, unsigned long period)
+{
+	if (task < _numTasks) {
+		_tasks[task].period = period;
+		_tasks[task].due = micros() + period;
+	}
+}
+
+unsigned long TaskScheduler::getPeriod(byte task)
+{
+	return task < _numTasks ? _tasks[task].period : 0;
+}
+
+void TaskScheduler::setCatchUp(byte task, byte ticks)
+{
+	if (task < _numTasks) {
+		_tasks[task].catchUp = ticks;
+	}
+}
+
+unsigned long TaskScheduler::getRuns(byte task)
+{
+	return task < _numTasks ? _tasks[task].runs : 0;
+}
+
+unsigned long TaskScheduler::getSkipped(byte task)
+{
+	return task < _numTasks ? _tasks[task].skipped : 0;
+}
+
+unsigned long TaskScheduler::getMaxLate(byte task)
+{
+	return task < _numTasks ? _tasks[task].maxLate : 0;
+}
+
+void TaskScheduler::clearStats(byte task)
+{
+	if (task < _numTasks) {
+		_tasks[task].runs = 0;
+		_tasks[task].skipped = 0;
+		_tasks[task].maxLate = 0;
+	}
+}
+
+void TaskScheduler::setPassBudget(unsigned long budget)
+{
+	_passBudget = budget;
+}
+
+/**
+ * Move a periodic task to its next due time on the grid. When more ticks
+ * than the catch-up limit are already due, the oldest are skipped so the
+ * task doesn't run in a long burst after a stall.
+ * @private
+ */
+void TaskScheduler::advance(SchedulerTask *task, unsigned long now)
+{
+	task->due += task->period;
+	if ((long)(now - task->due) >= 0) {
+		unsigned long missed = (now - task->due) / task->period + 1;
+		if (missed > task->catchUp) {
+			missed -= task->catchUp;
+			task->due += missed * task->period;
+			task->skipped += missed;
+		}
+	}
+}
+
+void TaskScheduler::run()
+{
+	unsigned long start = micros();
+	unsigned long now = start;
+
+	for (byte i = 0; i < _numTasks; i++) {
+		SchedulerTask *task = &_tasks[_order[i]];
+		if (task->period > 0 || task->priority > 0) {
+			now = micros();
+		}
+		if (task->period > 0 && (long)(now - task->due) < 0) {
+			continue;
+		}
+		if (task->priority > 0 && !task->deferred && now - start + task->budget > _passBudget) {
+			task->deferred = true;
+			continue;
+		}
+		task->deferred = false;
+		if (task->period > 0 && now - task->due > task->maxLate) {
+			task->maxLate = now - task->due;
+		}
+		task->runs++;
+		task->run();
+		if (task->period > 0) {
+			advance(task, now);
+		}
+	}
+}
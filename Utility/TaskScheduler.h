@@ -0,0 +1,83 @@
+/*
+  TaskScheduler runs the work of loop() as a list of tasks ordered by
+  priority. Each pass runs the tasks that are due, highest priority
+  (lowest number) first, so motion and input handling never wait behind
+  a long report.
+
+  Every task has a time budget, the micros it is expected to take at
+  most. Tasks of priority 0 always run. The others only start while the
+  pass stays within its own budget; otherwise they are put off to the
+  next pass, where they run in any case so they can't be starved.
+
+  Periodic tasks run on a fixed grid of due times, so lateness of one run
+  doesn't shift the next ones. A task that falls behind runs its missed
+  ticks on the following passes, up to its catch-up limit; ticks beyond
+  that are skipped and counted.
+  */
+
+#ifndef TaskScheduler_h
+#define TaskScheduler_h
+
+#if defined(ARDUINO) && ARDUINO >= 100
+#include "Arduino.h"
+#else
+#include "WProgram.h"
+#endif
+
+#ifndef SCHEDULER_MAX_TASKS
+#define SCHEDULER_MAX_TASKS 8
+#endif
+#define SCHEDULER_PASS_BUDGET 1000UL  // micros a pass may take before tasks are put off
+
+typedef void (*TaskFunction)();
+
+struct SchedulerTask {
+	TaskFunction run;
+	unsigned long period;     // micros between runs, 0 to run on every pass
+	unsigned long due;        // micros() of the next run
+	unsigned int budget;      // micros the task is expected to take at most
+	byte priority;
+	bool deferred;            // put off on the previous pass
+	byte catchUp;             // missed ticks run late at most, more are skipped
+	// statistics since the last clearStats()
+	unsigned long runs;
+	unsigned long skipped;
+	unsigned long maxLate;    // most micros a run started after its due time
+};
+
+class TaskScheduler
+{
+public:
+	TaskScheduler();
+
+	// add a task, tasks of the same priority run in the order they were
+	// added; returns the task id, or -1 when the list is full
+	signed char add(TaskFunction run, byte priority, unsigned long period, unsigned int budget);
+
+	// change the period of a task, its next run is one period from now
+	void setPeriod(byte task, unsigned long period);
+	unsigned long getPeriod(byte task);
+
+	// missed ticks of a periodic task that are still run, 0 by default
+	void setCatchUp(byte task, byte ticks);
+
+	unsigned long getRuns(byte task);
+	unsigned long getSkipped(byte task);
+	unsigned long getMaxLate(byte task);
+	void clearStats(byte task);
+
+	void setPassBudget(unsigned long budget);
+
+	// run the due tasks once, call from loop()
+	void run();
+
+private:
+	void advance(SchedulerTask *task, unsigned long now);
+
+	SchedulerTask _tasks[SCHEDULER_MAX_TASKS];
+	byte _order[SCHEDULER_MAX_TASKS];   // task ids by priority
+	byte _numTasks;
+	unsigned long _passBudget;
+};
+
+#endif
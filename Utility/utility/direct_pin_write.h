@@ -0,0 +1,34 @@
+#ifndef direct_pin_write_h_
+#define direct_pin_write_h_
+
+// DIRECT_PIN_WRITE(reg, clear, set) clears the bits in clear, then sets the
+// bits in set, of the output register found with PIN_TO_OUTREG(). Pins on
+// the same port can be changed together in a single write.
+
+#if defined(__AVR__)
+
+#define OUT_REG_TYPE			uint8_t
+#define PIN_TO_OUTREG(pin)		(portOutputRegister(digitalPinToPort(pin)))
+#define PIN_TO_OUTMASK(pin)		(digitalPinToBitMask(pin))
+// the read-modify-write must not be interrupted by an ISR writing the same port
+#define DIRECT_PIN_WRITE(reg, clear, set) do {		\
+		uint8_t sreg_ = SREG;				\
+		cli();						\
+		*(reg) = (*(reg) & ~(clear)) | (set);		\
+		SREG = sreg_;					\
+	} while (0)
+
+#elif defined(__SAM3X8E__)
+
+#define OUT_REG_TYPE			uint32_t
+#define PIN_TO_OUTREG(pin)		(&(digitalPinToPort(pin)->PIO_PER))
+#define PIN_TO_OUTMASK(pin)		(digitalPinToBitMask(pin))
+// PIO_CODR and PIO_SODR, no read-modify-write needed
+#define DIRECT_PIN_WRITE(reg, clear, set) do {		\
+		*((reg)+13) = (clear);				\
+		*((reg)+12) = (set);				\
+	} while (0)
+
+#endif
+
+#endif
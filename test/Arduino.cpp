@@ -0,0 +1,75 @@
+/*
+  Arduino.cpp - host stand-ins for the Arduino core, see Arduino.h
+  */
+
+#include "Arduino.h"
+
+int failures = 0;
+
+unsigned long mockMicros = 0;
+void (*mockDigitalWrite)(uint8_t pin, uint8_t value) = NULL;
+unsigned long mockNoInterrupts = 0;
+void (*mockInterruptHandlers[MOCK_INTERRUPTS])(void);
+
+uint8_t TCCR2A = (1 << WGM20);
+uint8_t TCCR2B = (1 << CS22);
+uint8_t OCR2A = 0;
+uint8_t TCNT2 = 0;
+uint8_t TIMSK2 = 0;
+uint8_t TIFR2 = 0;
+
+void pinMode(uint8_t, uint8_t)
+{
+}
+
+void digitalWrite(uint8_t pin, uint8_t value)
+{
+	if (mockDigitalWrite != NULL) {
+		mockDigitalWrite(pin, value);
+	}
+}
+
+int digitalRead(uint8_t)
+{
+	return LOW;
+}
+
+unsigned long micros()
+{
+	return mockMicros;
+}
+
+unsigned long millis()
+{
+	return mockMicros / 1000;
+}
+
+void delayMicroseconds(unsigned int)
+{
+}
+
+void noInterrupts()
+{
+	mockNoInterrupts++;
+}
+
+void interrupts()
+{
+}
+
+void attachInterrupt(uint8_t num, void (*handler)(void), int)
+{
+	mockInterruptHandlers[num] = handler;
+}
+
+void detachInterrupt(uint8_t num)
+{
+	mockInterruptHandlers[num] = NULL;
+}
+
+void mockInterrupt(uint8_t num)
+{
+	if (mockInterruptHandlers[num] != NULL) {
+		mockInterruptHandlers[num]();
+	}
+}
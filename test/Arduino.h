@@ -0,0 +1,96 @@
+/*
+  Minimal Arduino core for building the Utility classes on the host, see
+  run_tests.sh. Time only moves when a test sets mockMicros,
+  mockDigitalWrite lets a test watch the pins, and mockInterrupt() runs
+  the handler attached to an external interrupt. CHECK() counts the
+  failed conditions of a test in failures.
+  */
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+typedef unsigned int word;
+
+#define HIGH 0x1
+#define LOW  0x0
+
+#define INPUT        0x0
+#define OUTPUT       0x1
+#define INPUT_PULLUP 0x2
+
+#define CHANGE 1
+
+#define F_CPU 16000000L
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+unsigned long micros();
+unsigned long millis();
+void delayMicroseconds(unsigned int us);
+void noInterrupts();
+void interrupts();
+void attachInterrupt(uint8_t num, void (*handler)(void), int mode);
+void detachInterrupt(uint8_t num);
+
+extern unsigned long mockMicros;
+extern void (*mockDigitalWrite)(uint8_t pin, uint8_t value);
+extern unsigned long mockNoInterrupts;	// noInterrupts() calls so far
+
+#define MOCK_INTERRUPTS 8
+extern void (*mockInterruptHandlers[MOCK_INTERRUPTS])(void);
+void mockInterrupt(uint8_t num);
+
+// Timer2, as set up by the Arduino core for PWM on its pins
+extern uint8_t TCCR2A, TCCR2B, OCR2A, TCNT2, TIMSK2, TIFR2;
+#define WGM20  0
+#define WGM21  1
+#define CS20   0
+#define CS21   1
+#define CS22   2
+#define OCIE2A 1
+#define OCF2A  1
+
+#define ISR(vector) extern "C" void vector(void)
+
+class Print
+{
+public:
+	virtual ~Print() {}
+	virtual size_t write(uint8_t data) = 0;
+	virtual size_t write(const uint8_t *buffer, size_t size) {
+		size_t n = 0;
+		while (size--) {
+			n += write(*buffer++);
+		}
+		return n;
+	}
+	virtual void flush() {}
+};
+
+class Stream : public Print
+{
+public:
+	virtual int available() = 0;
+	virtual int read() = 0;
+	virtual int peek() = 0;
+};
+
+extern int failures;
+
+#define CHECK(cond) do { \
+		if (!(cond)) { \
+			printf("%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+			failures++; \
+		} \
+	} while (0)
+
+#endif
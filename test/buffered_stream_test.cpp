@@ -0,0 +1,137 @@
+/*
+  Host test of BufferedStream against a serial port with a 63-byte TX
+  buffer that only drains when the test says so, and counts the writes
+  that would have blocked.
+
+  - With setStreamSpace(), space() plus the serial space can be written
+    without blocking and without a stall; one byte more stalls once.
+  - Without it, a full buffer is written all at once, as before.
+  - Bytes come out complete and in order whatever the mix of writes,
+    flushAvailable() and draining.
+
+  g++ -DARDUINO=10800 -Itest -IUtility test/buffered_stream_test.cpp
+    test/Arduino.cpp Utility/BufferedStream.cpp
+  */
+
+#include <stdio.h>
+#include <vector>
+#include "Arduino.h"
+#include "BufferedStream.h"
+
+#define SERIAL_SPACE 63
+
+class MockSerial : public Stream
+{
+public:
+	MockSerial() : queued(0), blocked(0) {}
+
+	int available() { return 0; }
+	int read() { return -1; }
+	int peek() { return -1; }
+	size_t write(uint8_t data) { return write(&data, 1); }
+	size_t write(const uint8_t *buffer, size_t size) {
+		// a write larger than the free space waits for the line
+		if (queued + size > SERIAL_SPACE) {
+			blocked++;
+			drain();
+		}
+		for (size_t i = 0; i < size; i++) {
+			sent.push_back(buffer[i]);
+		}
+		queued += size;
+		if (queued > SERIAL_SPACE) {
+			queued = SERIAL_SPACE;
+		}
+		return size;
+	}
+
+	int space() { return SERIAL_SPACE - queued; }
+	void drain() { queued = 0; }
+
+	std::vector<uint8_t> sent;
+	size_t queued;            // bytes in the TX buffer
+	int blocked;
+};
+
+static MockSerial *serial;
+
+static int serialSpace()
+{
+	return serial->space();
+}
+
+static void testStreamSpace()
+{
+	MockSerial port;
+	BufferedStream stream(port);
+	serial = &port;
+	stream.setStreamSpace(serialSpace);
+
+	int room = stream.space() + port.space();
+	for (int i = 0; i < room; i++) {
+		stream.write((uint8_t)i);
+	}
+	CHECK(port.blocked == 0);
+	CHECK(stream.stalls() == 0);
+	CHECK(stream.space() == 0 && port.space() == 0);
+
+	stream.write(0);
+	CHECK(port.blocked == 1);
+	CHECK(stream.stalls() == 1);
+
+	stream.flush();
+	CHECK((int)port.sent.size() == room + 1);
+}
+
+static void testWithoutStreamSpace()
+{
+	MockSerial port;
+	BufferedStream stream(port);
+
+	for (int i = 0; i < BUFFERED_STREAM_SIZE + 1; i++) {
+		stream.write((uint8_t)i);
+	}
+	CHECK(port.blocked == 1);
+	CHECK(stream.stalls() == 1);
+	CHECK((int)port.sent.size() == BUFFERED_STREAM_SIZE);
+}
+
+static void testOrder()
+{
+	MockSerial port;
+	BufferedStream stream(port);
+	serial = &port;
+	stream.setStreamSpace(serialSpace);
+	int next = 0;
+
+	srand(1);
+	for (int round = 0; round < 10000; round++) {
+		int count = rand() % 200;
+		for (int i = 0; i < count; i++) {
+			stream.write((uint8_t)next++);
+		}
+		stream.flushAvailable(port.space());
+		CHECK(stream.pending() <= BUFFERED_STREAM_SIZE);
+		if (rand() % 2) {
+			port.drain();
+		}
+	}
+	stream.flush();
+	CHECK((int)port.sent.size() == next);
+	for (int i = 0; i < next && i < (int)port.sent.size(); i++) {
+		if (port.sent[i] != (uint8_t)i) {
+			CHECK(port.sent[i] == (uint8_t)i);
+			break;
+		}
+	}
+}
+
+int main()
+{
+	testStreamSpace();
+	testWithoutStreamSpace();
+	testOrder();
+
+	printf("%s\n", failures == 0 ? "buffered_stream_test passed" : "buffered_stream_test FAILED");
+	return failures == 0 ? 0 : 1;
+}
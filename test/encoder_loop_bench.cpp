@@ -0,0 +1,202 @@
+/*
+  Host test and benchmark of the interrupt-driven encoders.
+
+  - begin() in place hands the interrupts the array element, so the counts
+    land in the Encoder the sketch reads, and end() takes them back.
+  - Edge times are only taken by encoders that setCaptureTime(), and only
+    on edges that change the position.
+  - Compare a loop() pass reading every attached encoder, as it used to,
+    with one sampling only the polled encoders, while the interrupts count
+    edges in between. Both must end at the same positions; count the
+    noInterrupts() sections each pass takes and time the passes.
+
+  The pins are a byte array and four external interrupts sit on pins 2, 3,
+  18 and 19, as on a Mega. Encoder.cpp is built into this file so it sees
+  these stand-ins.
+
+  g++ -O2 -DARDUINO=10800 -Itest -IUtility test/encoder_loop_bench.cpp
+    test/Arduino.cpp
+  */
+
+#include <stdio.h>
+#include <chrono>
+#include "Arduino.h"
+
+static uint8_t pinLevels[32];
+
+#define CORE_NUM_INTERRUPT 4
+#define CORE_INT0_PIN 2
+#define CORE_INT1_PIN 3
+#define CORE_INT2_PIN 18
+#define CORE_INT3_PIN 19
+#define IO_REG_TYPE uint8_t
+#define PIN_TO_BASEREG(pin) (&pinLevels[pin])
+#define PIN_TO_BITMASK(pin) 1
+#define DIRECT_PIN_READ(base, mask) (((*(base)) & (mask)) ? 1 : 0)
+
+// the state and interrupt count are private
+#define private public
+#include "Encoder.cpp"
+#undef private
+
+#define NUM_ENCODERS 3
+#define PASSES 1000000
+
+static Encoder encoders[NUM_ENCODERS];
+
+static uint8_t interruptOf(uint8_t pin)
+{
+	switch (pin) {
+		case 2: return 0;
+		case 3: return 1;
+		case 18: return 2;
+		case 19: return 3;
+	}
+	return 0xFF;
+}
+
+// turn one count forward on the pins, firing the interrupt of the pin
+// that changes
+static void turn(uint8_t pin1, uint8_t pin2, uint8_t *phase)
+{
+	static const uint8_t GRAY[4] = { 0, 2, 3, 1 };
+	uint8_t from = GRAY[*phase];
+	uint8_t to = GRAY[(*phase + 1) & 3];
+	uint8_t pin = (from ^ to) & 1 ? pin1 : pin2;
+
+	*phase = (*phase + 1) & 3;
+	pinLevels[pin1] = to & 1;
+	pinLevels[pin2] = (to >> 1) & 1;
+	if (interruptOf(pin) != 0xFF) {
+		mockInterrupt(interruptOf(pin));
+	}
+}
+
+static void testInPlace()
+{
+	uint8_t phase = 0;
+
+	encoders[0].begin(2, 3);
+	CHECK(!encoders[0].isPolled());
+	CHECK(Encoder::interruptArgs[0] == &encoders[0].encoder);
+	CHECK(Encoder::interruptArgs[1] == &encoders[0].encoder);
+	for (int i = 0; i < 100; i++) {
+		turn(2, 3, &phase);
+	}
+	CHECK(encoders[0].encoder.position == 100);
+	CHECK(encoders[0].read() == 100);
+
+	encoders[0].end();
+	CHECK(mockInterruptHandlers[0] == NULL && mockInterruptHandlers[1] == NULL);
+	CHECK(Encoder::interruptArgs[0] == NULL && Encoder::interruptArgs[1] == NULL);
+	// the interrupts no longer count; read() would poll the pins
+	turn(2, 3, &phase);
+	CHECK(encoders[0].encoder.position == 100);
+
+	// attached again, it counts from zero
+	encoders[0].begin(2, 3);
+	for (int i = 0; i < 10; i++) {
+		turn(2, 3, &phase);
+	}
+	CHECK(encoders[0].read() == 10);
+	encoders[0].end();
+}
+
+static void testCapture()
+{
+	uint8_t phase = 0;
+
+	memset(pinLevels, 0, sizeof(pinLevels));
+	mockMicros = 1000;
+	encoders[0].begin(2, 3);
+	turn(2, 3, &phase);
+	mockMicros = 1200;
+	turn(2, 3, &phase);
+	CHECK(!encoders[0].isCapturingTime());
+	CHECK(encoders[0].readEdgeTime() == 0);
+	CHECK(encoders[0].readVelocity() == 0);
+
+	encoders[0].setCaptureTime(true);
+	mockMicros = 1500;
+	turn(2, 3, &phase);
+	mockMicros = 2000;
+	turn(2, 3, &phase);
+	CHECK(encoders[0].readEdgeTime() == 2000);
+	CHECK(encoders[0].readVelocity() == 2000);
+
+	// an interrupt that finds the pins unchanged takes no time
+	mockMicros = 2100;
+	mockInterrupt(0);
+	CHECK(encoders[0].read() == 4);
+	CHECK(encoders[0].readEdgeTime() == 2000);
+
+	// attached again, it starts without capture
+	encoders[0].end();
+	encoders[0].begin(2, 3);
+	CHECK(!encoders[0].isCapturingTime());
+	encoders[0].end();
+	mockMicros = 0;
+}
+
+// loop() passes with the edges of moving encoders in between, reading
+// each attached encoder or only the polled ones; returns ns per pass
+static double loopPasses(bool readAll, int32_t *positions, unsigned long *sections)
+{
+	static const uint8_t PINS[NUM_ENCODERS][2] = { { 2, 3 }, { 18, 19 }, { 4, 5 } };
+	uint8_t phases[NUM_ENCODERS] = { 0, 0, 0 };
+
+	memset(pinLevels, 0, sizeof(pinLevels));
+	for (int i = 0; i < NUM_ENCODERS; i++) {
+		encoders[i].begin(PINS[i][0], PINS[i][1]);
+	}
+	CHECK(!encoders[0].isPolled() && !encoders[1].isPolled() && encoders[2].isPolled());
+
+	unsigned long before = mockNoInterrupts;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int pass = 0; pass < PASSES; pass++) {
+		// a count on every encoder every 16 passes
+		if ((pass & 15) == 0) {
+			for (int i = 0; i < NUM_ENCODERS; i++) {
+				turn(PINS[i][0], PINS[i][1], &phases[i]);
+			}
+		}
+		for (int i = 0; i < NUM_ENCODERS; i++) {
+			if (readAll || encoders[i].isPolled()) {
+				encoders[i].read();
+			}
+		}
+	}
+	std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+	*sections = mockNoInterrupts - before;
+
+	// the report reads them all
+	for (int i = 0; i < NUM_ENCODERS; i++) {
+		positions[i] = encoders[i].read();
+		encoders[i].end();
+	}
+	return elapsed.count() / PASSES;
+}
+
+int main()
+{
+	int32_t all[NUM_ENCODERS], polled[NUM_ENCODERS];
+	unsigned long allSections, polledSections;
+
+	testInPlace();
+	testCapture();
+
+	double allTime = loopPasses(true, all, &allSections);
+	double polledTime = loopPasses(false, polled, &polledSections);
+	for (int i = 0; i < NUM_ENCODERS; i++) {
+		CHECK(all[i] == PASSES / 16);
+		CHECK(polled[i] == all[i]);
+	}
+	CHECK(allSections == (unsigned long)NUM_ENCODERS * PASSES);
+	CHECK(polledSections == PASSES);
+	printf("loop() pass, 2 interrupt and 1 polled encoder: %lu noInterrupts() reading all, %lu reading polled only\n",
+		allSections / PASSES, polledSections / PASSES);
+	printf("host loop() pass: %.1f ns reading all, %.1f ns reading polled only\n", allTime, polledTime);
+
+	printf("%s\n", failures == 0 ? "encoder_loop_bench passed" : "encoder_loop_bench FAILED");
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,194 @@
+/*
+  Host round trip test of the encoder report packing: positions, longs,
+  deltas and slot masks are packed by EncoderReport and unpacked by the
+  reference decoder below, the way a host reads ENCODER_DATA, across the
+  sign and 7-bit group boundaries. A stream of absolute and delta reports
+  is replayed to check the host ends up at every position.
+
+  g++ -DARDUINO=10800 -Itest -IUtility test/encoder_report_test.cpp
+    test/Arduino.cpp Utility/EncoderReport.cpp
+  */
+
+#include <stdio.h>
+#include "Arduino.h"
+#include "EncoderReport.h"
+
+#define MAX_28BIT ((1L << 28) - 1)
+
+// reference decoder
+
+static int32_t unpackPosition(const byte *in, byte *encoder)
+{
+	int32_t value = 0;
+	for (int i = 0; i < 4; i++) {
+		value |= (int32_t)in[i + 1] << (7 * i);
+	}
+	*encoder = in[0] & 0x3F;
+	return (in[0] & 0x40) ? -value : value;
+}
+
+static int32_t unpackLong(const byte *in)
+{
+	int32_t value = 0;
+	for (int i = 0; i < 4; i++) {
+		value |= (int32_t)in[i] << (7 * i);
+	}
+	// sign extend from bit 27
+	return value & (1L << 27) ? value - (1L << 28) : value;
+}
+
+static int32_t unpackDelta(const byte *in, int *length)
+{
+	uint32_t value = 0;
+	int i = 0;
+	do {
+		value |= (uint32_t)(in[i] & 0x3F) << (6 * i);
+	} while (in[i++] & 0x40);
+	*length = i;
+	return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+static bool all7Bit(const byte *data, int count)
+{
+	for (int i = 0; i < count; i++) {
+		if (data[i] & 0x80) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// values either side of each 7-bit and 6-bit group boundary
+static int boundaries(int32_t *values, int bits, int32_t limit)
+{
+	int count = 0;
+	values[count++] = 0;
+	for (int shift = 0; shift < 32; shift += bits) {
+		int32_t edge = (int32_t)(1UL << shift);
+		if (edge <= 0 || edge > limit) {
+			break;
+		}
+		values[count++] = edge - 1;
+		values[count++] = edge;
+	}
+	values[count++] = limit;
+	int positives = count;
+	for (int i = 1; i < positives; i++) {
+		values[count++] = -values[i];
+	}
+	return count;
+}
+
+static void testPositions()
+{
+	int32_t values[40];
+	int count = boundaries(values, 7, MAX_28BIT);
+	byte data[ENCODER_POSITION_BYTES];
+
+	for (int i = 0; i < count; i++) {
+		for (byte encoder = 0; encoder < 32; encoder += 31) {
+			byte decoded;
+			CHECK(packEncoderPosition(encoder, values[i], data) == ENCODER_POSITION_BYTES);
+			CHECK(all7Bit(data, ENCODER_POSITION_BYTES));
+			CHECK(unpackPosition(data, &decoded) == values[i]);
+			CHECK(decoded == encoder);
+		}
+	}
+}
+
+static void testLongs()
+{
+	int32_t values[40];
+	int count = boundaries(values, 7, (1L << 27) - 1);
+	byte data[ENCODER_LONG_BYTES];
+
+	values[count++] = -(1L << 27);
+	for (int i = 0; i < count; i++) {
+		CHECK(packEncoderLong(values[i], data) == ENCODER_LONG_BYTES);
+		CHECK(all7Bit(data, ENCODER_LONG_BYTES));
+		CHECK(unpackLong(data) == values[i]);
+	}
+}
+
+static void testDeltas()
+{
+	int32_t values[40];
+	int count = boundaries(values, 6, 0x7FFFFFFF);
+	byte data[ENCODER_DELTA_BYTES];
+	int length;
+
+	values[count++] = (int32_t)0x80000000;
+	values[count++] = 31;
+	values[count++] = -32;
+	values[count++] = 32;
+	values[count++] = -33;
+	for (int i = 0; i < count; i++) {
+		byte packed = packEncoderDelta(values[i], data);
+		CHECK(packed >= 1 && packed <= ENCODER_DELTA_BYTES);
+		CHECK(all7Bit(data, packed));
+		CHECK(unpackDelta(data, &length) == values[i]);
+		CHECK(length == packed);
+	}
+	// -32 to 31 fit one byte
+	CHECK(packEncoderDelta(31, data) == 1);
+	CHECK(packEncoderDelta(-32, data) == 1);
+	CHECK(packEncoderDelta(32, data) == 2);
+	CHECK(packEncoderDelta(-33, data) == 2);
+	CHECK(packEncoderDelta((int32_t)0x80000000, data) == 6);
+}
+
+static void testSlots()
+{
+	static const uint32_t MASKS[] = { 0x1, 0x40, 0x80, 0x3F80, 0x4000, 0x1FFFFF, 0x80000000, 0xFFFFFFFF };
+	byte data[5];
+
+	for (unsigned i = 0; i < sizeof(MASKS) / sizeof(MASKS[0]); i++) {
+		uint32_t decoded = 0;
+		CHECK(packEncoderSlots(MASKS[i], 5, data) == 5);
+		CHECK(all7Bit(data, 5));
+		for (int j = 0; j < 5; j++) {
+			decoded |= (uint32_t)data[j] << (7 * j);
+		}
+		CHECK(decoded == MASKS[i]);
+	}
+}
+
+// the host keeps positions from absolute reports and adds the deltas
+static void testDeltaStream()
+{
+	static const int32_t STEPS[] = { 1, -1, 31, 32, -33, 63, 64, -128, 4095, -4097, 262144, -16777216, 0, 7 };
+	int32_t position = 0;
+	int32_t reported = 0;
+	int32_t host = 0;
+	byte data[ENCODER_POSITION_BYTES + ENCODER_DELTA_BYTES];
+	byte encoder;
+	int length;
+
+	for (int pass = 0; pass < 3; pass++) {
+		for (unsigned i = 0; i < sizeof(STEPS) / sizeof(STEPS[0]); i++) {
+			position += pass == 1 ? -STEPS[i] : STEPS[i];
+			if (i % 5 == 0) {
+				packEncoderPosition(3, position, data);
+				host = unpackPosition(data, &encoder);
+			}
+			else {
+				packEncoderDelta(position - reported, data);
+				host += unpackDelta(data, &length);
+			}
+			reported = position;
+			CHECK(host == position);
+		}
+	}
+}
+
+int main()
+{
+	testPositions();
+	testLongs();
+	testDeltas();
+	testSlots();
+	testDeltaStream();
+
+	printf("%s\n", failures == 0 ? "encoder_report_test passed" : "encoder_report_test FAILED");
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,36 @@
+#!/bin/sh
+# Build and run the host tests of the Utility classes against the minimal
+# Arduino core in this directory. Run from the repository root.
+
+set -e
+OUT=${TMPDIR:-/tmp}/robust-firmata-tests
+mkdir -p "$OUT"
+CXX="${CXX:-g++} -std=gnu++11 -Wall -Wno-sign-compare -Wno-maybe-uninitialized -O2 -DARDUINO=10800 -Itest -IUtility"
+
+$CXX -DSTEPPER_USE_TIMER -o "$OUT/stepper_timer_test" test/stepper_timer_test.cpp \
+	test/Arduino.cpp Utility/Stepper.cpp Utility/StepperGroup.cpp
+"$OUT/stepper_timer_test"
+
+$CXX -o "$OUT/stepper_group_test" test/stepper_group_test.cpp \
+	test/Arduino.cpp Utility/Stepper.cpp Utility/StepperGroup.cpp
+"$OUT/stepper_group_test"
+
+$CXX -o "$OUT/stepper_math_test" test/stepper_math_test.cpp \
+	test/Arduino.cpp Utility/Stepper.cpp Utility/StepperGroup.cpp
+"$OUT/stepper_math_test"
+
+$CXX -DSTEPPER_USE_TIMER -DSTEPPER_RAMP_TABLES=2 -o "$OUT/stepper_ramp_bench" test/stepper_ramp_bench.cpp \
+	test/Arduino.cpp Utility/Stepper.cpp Utility/StepperGroup.cpp
+"$OUT/stepper_ramp_bench"
+
+$CXX -o "$OUT/encoder_report_test" test/encoder_report_test.cpp \
+	test/Arduino.cpp Utility/EncoderReport.cpp
+"$OUT/encoder_report_test"
+
+$CXX -o "$OUT/encoder_loop_bench" test/encoder_loop_bench.cpp \
+	test/Arduino.cpp
+"$OUT/encoder_loop_bench"
+
+$CXX -o "$OUT/buffered_stream_test" test/buffered_stream_test.cpp \
+	test/Arduino.cpp Utility/BufferedStream.cpp
+"$OUT/buffered_stream_test"
@@ -0,0 +1,185 @@
+/*
+  Host test of StepperGroup: the interpolator spreads each follower's steps
+  evenly over the leader's, a cancelled move leaves the followers' position
+  at the steps they really took, and a group with nothing to move is done
+  at once.
+
+  g++ -DARDUINO=10800 -Itest -IUtility test/stepper_group_test.cpp
+    test/Arduino.cpp Utility/Stepper.cpp Utility/StepperGroup.cpp
+  */
+
+#include <stdio.h>
+#include "Arduino.h"
+#include "Stepper.h"
+#include "StepperGroup.h"
+
+#define NUM_MOTORS 4
+
+// motor i has its direction pin on 2 * i + 2 and its step pin on 2 * i + 3
+static long pulses[NUM_MOTORS];
+static byte direction[NUM_MOTORS];
+
+static void countPulses(uint8_t pin, uint8_t value)
+{
+	byte motor = (pin - 2) / 2;
+	if (motor >= NUM_MOTORS) {
+		return;
+	}
+	if (pin & 1) {
+		if (value == HIGH) {
+			pulses[motor] += direction[motor] ? 1 : -1;
+		}
+	}
+	else {
+		direction[motor] = value;
+	}
+}
+
+static void createMotors(Stepper **motors)
+{
+	for (byte i = 0; i < NUM_MOTORS; i++) {
+		motors[i] = new Stepper(Stepper::DRIVER, 200, 2 * i + 2, 2 * i + 3);
+		pulses[i] = 0;
+	}
+}
+
+static void deleteMotors(Stepper **motors)
+{
+	for (byte i = 0; i < NUM_MOTORS; i++) {
+		delete motors[i];
+	}
+}
+
+// poll the leader until it reports done, or for at most duration micros
+static bool runLeader(Stepper *leader, unsigned long duration)
+{
+	unsigned long end = mockMicros + duration;
+	while (mockMicros < end) {
+		mockMicros++;
+		if (leader->update()) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void testNextStepSpreadsSteps()
+{
+	static const long STEPS[NUM_MOTORS] = { 1000, -370, 1, 999 };
+	Stepper *motors[NUM_MOTORS];
+	StepperGroup group;
+	long taken[NUM_MOTORS] = { 0 };
+	double worst = 0;
+
+	createMotors(motors);
+	for (byte i = 0; i < NUM_MOTORS; i++) {
+		CHECK(group.addAxis(motors[i], STEPS[i]));
+	}
+	CHECK(!group.addAxis(motors[1], 5));
+	CHECK(group.start(1000, 0, 0));
+	CHECK(group.isLeader(motors[0]));
+	CHECK(group.isFollower(motors[1]));
+
+	// step the interpolator by hand, the motors are never updated
+	for (long k = 1; k <= STEPS[0]; k++) {
+		byte mask = group.nextStep();
+		CHECK(mask & 0x01);
+		for (byte i = 1; i < NUM_MOTORS; i++) {
+			long steps = STEPS[i] < 0 ? -STEPS[i] : STEPS[i];
+			if (mask & (1 << i)) {
+				taken[i]++;
+			}
+			// never more than half a step off the straight line
+			double off = taken[i] - (double)k * steps / STEPS[0];
+			if (off < 0) {
+				off = -off;
+			}
+			if (off > worst) {
+				worst = off;
+			}
+		}
+	}
+	for (byte i = 1; i < NUM_MOTORS; i++) {
+		CHECK(taken[i] == (STEPS[i] < 0 ? -STEPS[i] : STEPS[i]));
+	}
+	CHECK(worst <= 0.5);
+	printf("interpolator: followers at most %.3f steps off the line\n", worst);
+
+	group.clear();
+	deleteMotors(motors);
+}
+
+static void testCompletedMove()
+{
+	static const long STEPS[3] = { -800, 300, -45 };
+	Stepper *motors[NUM_MOTORS];
+	StepperGroup group;
+
+	createMotors(motors);
+	for (byte i = 0; i < 3; i++) {
+		group.addAxis(motors[i], STEPS[i]);
+	}
+	CHECK(group.start(2000, 4000, 4000));
+	CHECK(runLeader(motors[0], 5000000));
+	group.clear();
+	for (byte i = 0; i < 3; i++) {
+		CHECK(pulses[i] == STEPS[i]);
+		CHECK(motors[i]->getPosition() == STEPS[i]);
+	}
+	deleteMotors(motors);
+}
+
+static void testCancelKeepsStepsTaken()
+{
+	Stepper *motors[NUM_MOTORS];
+	StepperGroup group;
+
+	createMotors(motors);
+	group.addAxis(motors[0], 1000);
+	group.addAxis(motors[1], -600);
+	group.addAxis(motors[2], 250);
+	CHECK(group.start(1000, 0, 0));
+
+	// stop part way, as a new STEPPER_STEP to the leader does
+	CHECK(!runLeader(motors[0], 400 * (ALPHA_T1_FREQ_X100 / 200 / 1000)));
+	group.clear();
+	CHECK(pulses[1] < 0 && pulses[1] > -600);
+	CHECK(pulses[2] > 0 && pulses[2] < 250);
+	CHECK(motors[1]->getPosition() == pulses[1]);
+	CHECK(motors[2]->getPosition() == pulses[2]);
+	CHECK(motors[1]->getDistanceTo() == 0);
+
+	// the leader finishes its own move without dragging the others along
+	long follower = pulses[1];
+	CHECK(runLeader(motors[0], 5000000));
+	CHECK(pulses[0] == 1000);
+	CHECK(pulses[1] == follower);
+	deleteMotors(motors);
+}
+
+static void testNothingToMove()
+{
+	Stepper *motors[NUM_MOTORS];
+	StepperGroup group;
+
+	createMotors(motors);
+	group.addAxis(motors[0], 0);
+	group.addAxis(motors[1], 0);
+	CHECK(!group.start());
+	CHECK(!group.contains(motors[0]));
+	CHECK(!group.isLeader(motors[0]));
+	deleteMotors(motors);
+}
+
+int main()
+{
+	mockDigitalWrite = countPulses;
+
+	testNextStepSpreadsSteps();
+	testCompletedMove();
+	testCancelKeepsStepsTaken();
+	testNothingToMove();
+
+	printf("%s\n", failures == 0 ? "stepper_group_test passed" : "stepper_group_test FAILED");
+	return failures == 0 ? 0 : 1;
+}
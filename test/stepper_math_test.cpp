@@ -0,0 +1,83 @@
+/*
+  Host test of the integer profile math of Stepper against the float
+  formulas it replaced, computed here in double precision: the alpha
+  constants and the initial ramp delay, over the steps_per_rev and accel
+  range STEPPER_CONFIG and STEPPER_STEP can send (14 bits each).
+
+  g++ -DARDUINO=10800 -Itest -IUtility test/stepper_math_test.cpp
+    test/Arduino.cpp Utility/Stepper.cpp Utility/StepperGroup.cpp
+  */
+
+#include <math.h>
+#include <stdio.h>
+#include "Arduino.h"
+
+// initialDelay() and the constants are private
+#define private public
+#include "Stepper.h"
+#undef private
+
+#define MAX_14BIT 16383
+
+static double worstConstant = 0;
+static double worstDelay = 0;
+static int worstSpr = 0;
+static int worstAccel = 0;
+
+static void compare(Stepper *motor, int spr, int accel)
+{
+	double alpha = 2 * M_PI / spr;
+	// step_delay = T1_FREQ_148 * sqrt(2 * alpha / accel) * 1000
+	double exact = T1_FREQ_148 * sqrt(2 * alpha / accel) * 1000;
+	// beyond rounding to whole micros
+	double error = fabs(motor->initialDelay(accel) - exact) - 0.5;
+
+	error = error > 0 ? error / exact : 0;
+
+	if (error > worstDelay) {
+		worstDelay = error;
+		worstSpr = spr;
+		worstAccel = accel;
+	}
+}
+
+static void checkConstants(Stepper *motor, int spr)
+{
+	double alpha = 2 * M_PI / spr;
+	double error = fabs(motor->_at_x100 - alpha * T1_FREQ * 100);
+
+	if (fabs(motor->_ax20000 - alpha * 20000) > error) {
+		error = fabs(motor->_ax20000 - alpha * 20000);
+	}
+	if (error > worstConstant) {
+		worstConstant = error;
+	}
+}
+
+int main()
+{
+	static const int ACCELS[] = { 1, 2, 3, 5, 7, 10, 33, 100, 1000, 5000, MAX_14BIT };
+	static const int SPRS[] = { 1, 2, 3, 24, 48, 200, 400, 3200, MAX_14BIT };
+
+	for (int spr = 1; spr <= MAX_14BIT; spr++) {
+		Stepper motor(Stepper::DRIVER, spr, 2, 3);
+		checkConstants(&motor, spr);
+		for (unsigned i = 0; i < sizeof(ACCELS) / sizeof(ACCELS[0]); i++) {
+			compare(&motor, spr, ACCELS[i]);
+		}
+	}
+	for (unsigned i = 0; i < sizeof(SPRS) / sizeof(SPRS[0]); i++) {
+		Stepper motor(Stepper::DRIVER, SPRS[i], 2, 3);
+		for (int accel = 1; accel <= MAX_14BIT; accel++) {
+			compare(&motor, SPRS[i], accel);
+		}
+	}
+
+	CHECK(worstConstant < 1);
+	CHECK(worstDelay < 0.00002);
+	printf("alpha constants at most %.3f off, initial delay at most 0.5 us + %.5f%% off (%d steps per rev, accel %d)\n",
+		worstConstant, worstDelay * 100, worstSpr, worstAccel);
+
+	printf("%s\n", failures == 0 ? "stepper_math_test passed" : "stepper_math_test FAILED");
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,150 @@
+/*
+  Host benchmark of the stepper ramp tables against the divide path.
+
+  - A replayed move takes exactly the delays of the move that recorded it.
+  - Count the ramp divisions a replayed move saves.
+  - With the timer, update() works the ramp delays out ahead, so a move
+    with update() every 5 ms takes as long as with update() on every tick,
+    whether it records or replays the ramp.
+  - Time step() on the host. The host divides in a few cycles where an AVR
+    takes several hundred, so this only shows the lookup costs no more.
+
+  g++ -O2 -DARDUINO=10800 -DSTEPPER_USE_TIMER -DSTEPPER_RAMP_TABLES=2
+    -Itest -IUtility test/stepper_ramp_bench.cpp test/Arduino.cpp
+    Utility/Stepper.cpp Utility/StepperGroup.cpp
+  */
+
+#include <stdio.h>
+#include <chrono>
+#include <vector>
+#include "Arduino.h"
+
+// step() and the ramp state are private
+#define private public
+#include "Stepper.h"
+#undef private
+
+#define STEPS 600
+#define SPEED 1500
+#define RAMP_ACCELERATION 3000
+#define MOVES 20000
+
+static int lookups;
+static int divisions;
+static unsigned long lastStep;
+
+static void recordStep(uint8_t pin, uint8_t value)
+{
+	if (pin == 3 && value == HIGH) {
+		lastStep = mockMicros;
+	}
+}
+
+// the ramp delay the next step() takes is looked up or divided out
+static void countRampStep(Stepper *motor)
+{
+	if (motor->_run_state == Stepper::ACCEL || motor->_run_state == Stepper::DECEL) {
+		if (Stepper::replayRamp(motor->_ramp, motor->_run_state, motor->_accel_count + 1)) {
+			lookups++;
+		}
+		else {
+			divisions++;
+		}
+	}
+}
+
+// run a move to the end with step() and return the delays it took
+static std::vector<unsigned long> delays(Stepper *motor, int speed)
+{
+	std::vector<unsigned long> taken;
+
+	lookups = 0;
+	divisions = 0;
+	motor->setStepsToMove(STEPS, speed, RAMP_ACCELERATION, RAMP_ACCELERATION);
+	for (;;) {
+		countRampStep(motor);
+		if (motor->step()) {
+			break;
+		}
+		taken.push_back(motor->_step_delay);
+	}
+	return taken;
+}
+
+// micros to the last step of a move from the timer, with update() every
+// loopPeriod micros
+static unsigned long timedMove(Stepper *motor, int speed, unsigned long loopPeriod)
+{
+	unsigned long start = mockMicros;
+	unsigned long nextLoop = start;
+
+	motor->setStepsToMove(STEPS, speed, RAMP_ACCELERATION, RAMP_ACCELERATION);
+	for (;;) {
+		mockMicros += STEPPER_TIMER_TICK;
+		Stepper::timerTick();
+		if (mockMicros >= nextLoop) {
+			if (motor->update()) {
+				return lastStep - start;
+			}
+			nextLoop += loopPeriod;
+		}
+	}
+}
+
+// nanoseconds of step() per move
+static double timeMoves(Stepper *motor, int speed)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	unsigned long sum = 0;
+
+	for (int i = 0; i < MOVES; i++) {
+		motor->setStepsToMove(STEPS, speed, RAMP_ACCELERATION, RAMP_ACCELERATION);
+		while (!motor->step()) {
+			sum += motor->_step_delay;
+		}
+	}
+	std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+	// keep the loop from being optimized away
+	if (sum == 0) {
+		printf("no steps\n");
+	}
+	return elapsed.count() / MOVES;
+}
+
+int main()
+{
+	Stepper motor(Stepper::DRIVER, 200, 2, 3);
+
+	mockDigitalWrite = recordStep;
+
+	// the first move records the table, the second replays it
+	std::vector<unsigned long> recorded = delays(&motor, SPEED);
+	int recordDivisions = divisions;
+	CHECK(motor._ramp != NULL && motor._ramp->ready == (RAMP_ACCEL | RAMP_DECEL));
+	std::vector<unsigned long> replayed = delays(&motor, SPEED);
+	CHECK(replayed == recorded);
+	CHECK(lookups == 2 * STEPPER_RAMP_TABLE_SIZE);
+	printf("ramp divisions per move: %d recording, %d replaying\n", recordDivisions, divisions);
+
+	// the timer with update() every 5 ms against update() on every tick
+	Stepper::clearRampTables();
+	unsigned long ideal = timedMove(&motor, SPEED, STEPPER_TIMER_TICK);
+	Stepper::clearRampTables();
+	unsigned long recording = timedMove(&motor, SPEED, 5000);
+	unsigned long replaying = timedMove(&motor, SPEED, 5000);
+	CHECK(recording == ideal && replaying == ideal);
+	printf("timed move with update() every 5 ms: %lu us recording, %lu us replaying, %lu us ideal\n",
+		recording, replaying, ideal);
+
+	// take both tables, so a third profile gets none
+	delays(&motor, SPEED - 1);
+	delays(&motor, SPEED - 2);
+	CHECK(motor._ramp == NULL);
+
+	double lookup = timeMoves(&motor, SPEED);
+	double divide = timeMoves(&motor, SPEED - 2);
+	printf("host step() per move: %.0f ns with the ramp table, %.0f ns dividing\n", lookup, divide);
+
+	printf("%s\n", failures == 0 ? "stepper_ramp_bench passed" : "stepper_ramp_bench FAILED");
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,223 @@
+/*
+  Host test of the Timer2 stepping of Stepper: the timer only runs while
+  a stepper is moving, steps stay within one tick of their due time, and
+  ramp steps take the delays update() worked out ahead, so a ramped move
+  and a run of queued moves step at the same times whether update() comes
+  on every tick or every 5 ms. Also counts and times the timer ticks.
+
+  g++ -DARDUINO=10800 -DSTEPPER_USE_TIMER -Itest -IUtility test/stepper_timer_test.cpp
+    test/Arduino.cpp Utility/Stepper.cpp Utility/StepperGroup.cpp
+  */
+
+#include <stdio.h>
+#include <chrono>
+#include <vector>
+#include "Arduino.h"
+#include "Stepper.h"
+
+// step pin of each test motor, the direction pins are pin - 1
+static const byte STEP_PINS[2] = { 3, 5 };
+static std::vector<unsigned long> stepTimes[2];
+static unsigned long ticks;
+
+static void recordStep(uint8_t pin, uint8_t value)
+{
+	for (byte i = 0; i < 2; i++) {
+		if (pin == STEP_PINS[i] && value == HIGH) {
+			stepTimes[i].push_back(mockMicros);
+		}
+	}
+}
+
+static bool timerOn()
+{
+	return TIMSK2 & (1 << OCIE2A);
+}
+
+// run the timer for a while, calling update() every loopPeriod micros
+static void run(Stepper **motors, byte count, unsigned long duration, unsigned long loopPeriod)
+{
+	unsigned long end = mockMicros + duration;
+	unsigned long nextLoop = mockMicros;
+
+	while (mockMicros < end) {
+		mockMicros += STEPPER_TIMER_TICK;
+		if (timerOn()) {
+			Stepper::timerTick();
+			ticks++;
+		}
+		if (mockMicros >= nextLoop) {
+			for (byte i = 0; i < count; i++) {
+				motors[i]->update();
+			}
+			nextLoop += loopPeriod;
+		}
+	}
+}
+
+static void testTimerLifecycle()
+{
+	uint8_t pwmTCCR2A = TCCR2A;
+	uint8_t pwmTCCR2B = TCCR2B;
+
+	Stepper *a = new Stepper(Stepper::DRIVER, 200, 2, 3);
+	Stepper *b = new Stepper(Stepper::DRIVER, 200, 4, 5);
+	CHECK(!timerOn());
+	CHECK(TCCR2B == pwmTCCR2B);
+
+	a->setStepsToMove(10, 1000, 0, 0);
+	CHECK(timerOn());
+	CHECK(TCCR2A == (1 << WGM21));
+	CHECK(TCCR2B == (1 << CS21));
+	CHECK(OCR2A == 2 * STEPPER_TIMER_TICK - 1);
+
+	// the timer stops by itself once the move is done, 10 steps of 3141 us
+	ticks = 0;
+	run(&a, 1, 100000, 500);
+	CHECK(!timerOn());
+	CHECK(TCCR2A == pwmTCCR2A);
+	CHECK(TCCR2B == pwmTCCR2B);
+	// one more step delay for the move to report done
+	CHECK(ticks * STEPPER_TIMER_TICK >= 11 * 3141 && ticks * STEPPER_TIMER_TICK < 11 * 3141 + STEPPER_TIMER_TICK);
+	CHECK(a->getPosition() == 10);
+
+	// and starts again with the next move, also a queued one
+	CHECK(a->queueMove(10, 1000, 0, 0));
+	CHECK(timerOn());
+	delete a;
+	CHECK(!timerOn());
+	CHECK(TCCR2A == pwmTCCR2A);
+	CHECK(TCCR2B == pwmTCCR2B);
+	b->setStepsToMove(10, 1000, 0, 0);
+	CHECK(timerOn());
+	delete b;
+	CHECK(!timerOn());
+	printf("10 steps of 3141 us: %lu timer ticks, none once the move is done\n", ticks);
+}
+
+static void testConstantSpeedJitter()
+{
+	// 3141 and 471 micros per step, neither a multiple of the tick
+	static const int SPR[2] = { 200, 400 };
+	static const int SPEED[2] = { 1000, 3333 };
+	static const long STEPS[2] = { 300, 2000 };
+	Stepper *motors[2];
+	unsigned long start = mockMicros;
+
+	for (byte i = 0; i < 2; i++) {
+		stepTimes[i].clear();
+		motors[i] = new Stepper(Stepper::DRIVER, SPR[i], STEP_PINS[i] - 1, STEP_PINS[i]);
+		motors[i]->setStepsToMove(STEPS[i], SPEED[i], 0, 0);
+	}
+	run(motors, 2, 1000000, 500);
+
+	for (byte i = 0; i < 2; i++) {
+		unsigned long delay = ALPHA_T1_FREQ_X100 / SPR[i] / SPEED[i];
+		long worst = 0;
+		bool inBounds = true;
+
+		CHECK(stepTimes[i].size() == (size_t)STEPS[i]);
+		for (size_t k = 0; k < stepTimes[i].size(); k++) {
+			long late = (long)(stepTimes[i][k] - (start + (k + 1) * delay));
+			if (late < 0 || late >= STEPPER_TIMER_TICK) {
+				inBounds = false;
+			}
+			if (late > worst) {
+				worst = late;
+			}
+		}
+		CHECK(inBounds);
+		CHECK(motors[i]->getPosition() == STEPS[i]);
+		printf("motor %d: %lu us per step, latest step %ld us after its due time\n",
+			i, delay, worst);
+		delete motors[i];
+	}
+}
+
+// run ramped moves and return the times of their steps
+static std::vector<unsigned long> rampedMoves(unsigned long loopPeriod, byte moves)
+{
+	Stepper *motor = new Stepper(Stepper::DRIVER, 200, STEP_PINS[0] - 1, STEP_PINS[0]);
+	unsigned long start = mockMicros;
+	unsigned long minDelay = ALPHA_T1_FREQ_X100 / 200 / 2000;
+
+	stepTimes[0].clear();
+	motor->setStepsToMove(1000, 2000, 3000, 3000);
+	for (byte i = 1; i < moves; i++) {
+		// these run on from the previous move without stopping
+		motor->queueMove(500 * i, 2000 + 500 * i, 3000, 3000);
+	}
+	run(&motor, 1, 3000000 * moves, loopPeriod);
+
+	long steps = 1000 + 500L * moves * (moves - 1) / 2;
+	CHECK((long)stepTimes[0].size() == steps);
+	CHECK(motor->getPosition() == steps);
+	CHECK(!timerOn());
+	// never faster than the max speed allows, so no burst after a wait
+	for (size_t k = 1; moves == 1 && k < stepTimes[0].size(); k++) {
+		if (stepTimes[0][k] - stepTimes[0][k - 1] + STEPPER_TIMER_TICK <= minDelay) {
+			CHECK(stepTimes[0][k] - stepTimes[0][k - 1] + STEPPER_TIMER_TICK > minDelay);
+			break;
+		}
+	}
+	delete motor;
+	for (size_t k = 0; k < stepTimes[0].size(); k++) {
+		stepTimes[0][k] -= start;
+	}
+	return stepTimes[0];
+}
+
+static void testRampTiming()
+{
+	std::vector<unsigned long> fast = rampedMoves(STEPPER_TIMER_TICK, 1);
+	std::vector<unsigned long> slow = rampedMoves(5000, 1);
+
+	// the same steps at the same times, the ramps don't wait for loop()
+	CHECK(slow == fast);
+	printf("ramped move: %lu us with update() every tick, %lu us every 5000 us\n",
+		fast.back(), slow.back());
+
+	fast = rampedMoves(STEPPER_TIMER_TICK, 3);
+	slow = rampedMoves(5000, 3);
+	CHECK(slow == fast);
+	printf("3 queued ramped moves: %lu us with update() every tick, %lu us every 5000 us\n",
+		fast.back(), slow.back());
+}
+
+// host time of a timer tick with the most steppers, one of them stepping
+static void testTickTime()
+{
+	Stepper *motors[STEPPER_MAX_TIMED];
+	unsigned long steps;
+
+	for (byte i = 0; i < STEPPER_MAX_TIMED; i++) {
+		motors[i] = new Stepper(Stepper::DRIVER, 200, 20 + 2 * i, 21 + 2 * i);
+	}
+	motors[0]->setStepsToMove(1000000, 2000, 3000, 3000);
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (steps = 0; steps < 1000000; steps++) {
+		Stepper::timerTick();
+		if ((steps & 63) == 0) {
+			motors[0]->update();
+		}
+	}
+	std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+	printf("host timer tick: %.1f ns with %d steppers, one stepping\n", elapsed.count() / steps, STEPPER_MAX_TIMED);
+	for (byte i = 0; i < STEPPER_MAX_TIMED; i++) {
+		delete motors[i];
+	}
+	CHECK(!timerOn());
+}
+
+int main()
+{
+	mockDigitalWrite = recordStep;
+
+	testTimerLifecycle();
+	testConstantSpeedJitter();
+	testRampTiming();
+	testTickTime();
+
+	printf("%s\n", failures == 0 ? "stepper_timer_test passed" : "stepper_timer_test FAILED");
+	return failures == 0 ? 0 : 1;
+}